@@ -9,19 +9,78 @@
 #define UINT16_T_LIMIT 65535
 
 #define CALL_FRAMES_MAX 128
+// Heap sizing, each can be set with a command line option or an environment variable: --gc-initial / CLOX_GC_INITIAL, ...
+// Bytes allocated at which the first gc runs
 #define INITIAL_GC_TRIGGER_VALUE 1024*1024
+// After a gc, the next one runs once the heap grew GC_GROWTH_FACTOR times what survived, or reached GC_MIN_HEAP bytes
+#define GC_GROWTH_FACTOR 2.0
+#define GC_MIN_HEAP (1024 * 1024)
+// Allocations that would take the heap past GC_MAX_HEAP bytes run a full gc, and raise a runtime error if that did not free enough (0 for no limit)
+#define GC_MAX_HEAP 0
+#define NURSERY_SIZE (256 * 1024)
+// Incremental gc: bytes of queued objects marked by one slice, and bytes allocated between two slices
+// A slice that fell behind the allocations does at most GC_MAX_SLICE_STEPS times its budget, the next ones then run on every allocation until it caught up
+#define GC_SLICE_BUDGET (64 * 1024)
+#define GC_SLICE_ALLOCATION (32 * 1024)
+#define GC_MAX_SLICE_STEPS 4
+// Most objects a slice sweeps, sweeping an object costs less than marking one
+#define GC_SWEEP_BUDGET 10000
+// When the old generation is compacted, unless set with the --gc-compact option (see CompactMode in "vm/gc.h")
+// Fragmented means a compaction would release at least GC_COMPACT_MIN_PAGES pages, and GC_COMPACT_THRESHOLD percent of the pages
+#define GC_COMPACT_MODE COMPACT_WHEN_FRAGMENTED
+#define GC_COMPACT_MIN_PAGES 4
+#define GC_COMPACT_THRESHOLD 25
+// Threads marking the heap, unless set with the --gc-threads option
+#define GC_MARK_THREADS 1
+#define GC_MAX_MARK_THREADS 64
+// Concatenations at least ROPE_MIN_LENGTH characters long make a rope, shorter ones are copied right away
+#define ROPE_MIN_LENGTH 64
+// Bytes allocated between two samples of the allocation profiler, unless set with the --alloc-sample option
+#define ALLOCATION_SAMPLE_INTERVAL (256 * 1024)
+
+// Represent every Value as a single NaN-boxed 64-bit word instead of a tagged struct
+// Remove this define to fall back to the tagged struct representation
+#define NAN_BOXING
+
+// Use direct threaded dispatch (labels as values) in the VM loop when the compiler supports it
+// Otherwise the VM falls back to the portable switch statement
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO
+#endif
+
+// Mark with several threads (see GC_MARK_THREADS) when the compiler has the atomic builtins the work-stealing deques need
+// Otherwise the heap is always marked by the vm thread
+#if defined(__GNUC__) || defined(__clang__)
+#define PARALLEL_MARKING
+#endif
+
+// Probe hash tables 16 slots at a time with SSE2, with the keys, values and control bytes stored apart (see "vm/table.h")
+// Otherwise, or without this define, tables fall back to linear probing over an array of key/value entries
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#define SWISS_TABLE
+#endif
+
+// Allocate new objects in a bump allocated nursery that minor gcs empty by promoting the survivors to the old generation
+// Remove this define to allocate every object in the old generation (a single mark and sweep heap)
+#define GENERATIONAL_GC
+
+// Mark the heap in bounded slices interleaved with the allocations instead of stopping the world for the whole mark phase
+// Remove this define to mark every reachable object at once
+#define INCREMENTAL_GC
 
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_PRINT_CODE
 #define DEBUG_LOG_GC
 #define EXCESSIVE_GC_MODE
 #define RUN_GC_AT_END
+#define DEBUG_SLAB_STATS
 
 #undef DEBUG_TRACE_EXECUTION
 #undef DEBUG_PRINT_CODE
 #undef EXCESSIVE_GC_MODE
 #undef RUN_GC_AT_END
 #undef DEBUG_LOG_GC
+#undef DEBUG_SLAB_STATS
 
 
 #endif
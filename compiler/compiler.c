@@ -10,6 +10,8 @@
 #include "../debug/disassembler.h"
 #endif
 
+extern VM vm;
+
 // Function prototypes
 
 // Token-handling functions
@@ -20,6 +22,8 @@ static void advanceToken();
 
 // Helper functions
 static int parseGlobalVariable();
+static int identifierConstant();
+static void emitGlobalSlotInstruction(uint8_t, int);
 static void handleLocalVariable();
 static void addSuperAsLocalVariable();
 static void beginScope();
@@ -38,6 +42,9 @@ static int getValueConstantIndex(Value);
 static void emitByte(uint8_t);
 static void emitBytes(uint8_t, uint8_t);
 static int emitJump(uint8_t);
+static int emitConditionalJump();
+static void emitExpressionPop(int);
+static void emitInlineCache();
 static void patchJump(int, uint8_t);
 static ObjectFunction* endCompiler();
 static void emitReturn(bool,Token);
@@ -133,8 +140,13 @@ void initCompiler(Compiler* compiler, FunctionType type){
 	compiler->currentScopeDepth = 0;
 	compiler->currentLocalsCount = 0;
 	compiler->currentUpvaluesCount = 0;
+	compiler->lastComparisonIndex = -1;
+	compiler->lastJumpTargetIndex = -1;
 
 	compiler->type = type;
+	// Becomes the current compiler before allocating anything so that the gc finds its function as a root
+	compiler->function = NULL;
+	currentCompiler = compiler;
 	compiler->function = makeNewFunctionObject(type);
 
 	// Assign first slot to the current function
@@ -146,7 +158,11 @@ void initCompiler(Compiler* compiler, FunctionType type){
 
 	if (type != FUNCTION_MAIN){
 		compiler->function->name = makeStringObject(parser.previousToken.start, parser.previousToken.length);
+		WRITE_BARRIER(compiler->function, OBJECT(compiler->function->name));
 		if (type == METHOD || type == METHOD_INIT){
+			// Method names get their selector (vtable index) at compile time
+			getSelector(compiler->function->name);
+
 			// Store `this` as the first "hidden" local variable for methods
 			local->name.start = "this";
 			local->name.length = 4;
@@ -157,8 +173,6 @@ void initCompiler(Compiler* compiler, FunctionType type){
 	} else{
 		currentCompilingClass = NULL;
 	}
-
-	currentCompiler = compiler;
 }
 
 ObjectFunction* compile(const char* source){
@@ -199,10 +213,10 @@ static void parseVarDeclaration(){
 	// make Lox string with current token and add it to chunk's constant table
 	consumeToken(TOKEN_IDENTIFIER, "Expect variable name");
 
-	uint8_t index;
+	int slot = 0;
 	if (currentCompiler->currentScopeDepth == 0){
 		// Global variable
-		index = parseGlobalVariable();
+		slot = parseGlobalVariable();
 
 	} else {
 		// Local variable handling
@@ -217,8 +231,8 @@ static void parseVarDeclaration(){
 
 	consumeToken(TOKEN_SEMICOLON, "Expected ';' after end of var declaration");
 
-	// emit byte to add it to global hash table
-	if (currentCompiler->currentScopeDepth == 0) emitBytes(OP_DEFINE_GLOBAL, index);
+	// emit bytes to define it in its global slot
+	if (currentCompiler->currentScopeDepth == 0) emitGlobalSlotInstruction(OP_DEFINE_GLOBAL_SLOT, slot);
 	else markInitialized();
 }
 
@@ -241,9 +255,9 @@ static void parseFunction(FunctionType type){
 	function->arity = nargs;
 	function->upvaluesCount = newCompiler.currentUpvaluesCount;
 
-	emitByte(OP_CLOSURE);
+	// The function is no longer a compiler root, so it becomes a constant before anything else gets allocated
 	int funcIndex = addConstantAndCheckLimit(OBJECT(function));
-	emitByte(funcIndex);
+	emitBytes(OP_CLOSURE, funcIndex);
 
 	for (int i=0; i< newCompiler.currentUpvaluesCount; i++){
 		Upvalue upvalue = newCompiler.upvalues[i];
@@ -255,11 +269,11 @@ static void parseFunction(FunctionType type){
 // funDec -> "fun" IDENTIFIER "(" IDENTIFIER ? ("," IDENTIFIER)* ")" block
 static void parseFuncDeclaration(){
 	consumeToken(TOKEN_IDENTIFIER, "Expect variable name");
-	uint8_t index;
+	int slot = 0;
 
 	if (currentCompiler->currentScopeDepth == 0){
 		// Global variable
-		index = parseGlobalVariable();
+		slot = parseGlobalVariable();
 
 	} else {
 		// Local variable handling
@@ -268,8 +282,8 @@ static void parseFuncDeclaration(){
 	}
 
 	parseFunction(FUNCTION);	
-	// emit byte to add it to global hash table if it is a global variable
-	if (currentCompiler->currentScopeDepth == 0) emitBytes(OP_DEFINE_GLOBAL, index);
+	// emit bytes to define it in its global slot if it is a global variable
+	if (currentCompiler->currentScopeDepth == 0) emitGlobalSlotInstruction(OP_DEFINE_GLOBAL_SLOT, slot);
 }
 
 
@@ -279,7 +293,7 @@ static void parseClassDeclaration(){
 	uint8_t index;
 
 	// Add name LoxString object to the constant table no matter what( even if it is in local context )
-	index = parseGlobalVariable();
+	index = identifierConstant();
 	if (currentCompiler->currentScopeDepth != 0){
 		// Local variable handling
 		handleLocalVariable();
@@ -294,7 +308,7 @@ static void parseClassDeclaration(){
 	newCompilingClass.hasSuperClass = false;
 	currentCompilingClass = &newCompilingClass;
 
-	if (currentCompiler->currentScopeDepth == 0) emitBytes(OP_DEFINE_GLOBAL, index);
+	if (currentCompiler->currentScopeDepth == 0) emitGlobalSlotInstruction(OP_DEFINE_GLOBAL_SLOT, parseGlobalVariable());
 
 	// push the class object on the top again since we will need it to bind the methods to the class
 	parseIdentifier(false);
@@ -400,9 +414,10 @@ static void parseBlockStatement(){
 
 // exprStatement -> expr ";"
 static void parseExpressionStatement(){
+	int start = currentChunk()->count;
 	parseExpression();
 	consumeToken(TOKEN_SEMICOLON, "Expected ';' after end of expression");
-	emitByte(OP_POP);
+	emitExpressionPop(start);
 }
 
 // printStatement -> "print" expression ";"
@@ -418,20 +433,19 @@ static void parseIfStatement(){
 	parseExpression();
 	consumeToken(TOKEN_RIGHT_PAREN, "Expect ')' after if");
 	
-	int index = emitJump(OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);
+	int index = emitConditionalJump();
 
 	parseStatement();
-	int endIndex = emitJump(OP_JUMP);
 
 	// Use backpatching	
-	patchJump(index, OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);
 	if (matchToken(TOKEN_ELSE)){
+		int endIndex = emitJump(OP_JUMP);
+		patchJump(index, OP_POP_JUMP_IF_FALSE);
 		parseStatement();
+		patchJump(endIndex, OP_JUMP);
+	} else{
+		patchJump(index, OP_POP_JUMP_IF_FALSE);
 	}
-
-	patchJump(endIndex, OP_JUMP);
 }
 
 // forStatement -> "for" "(" ";" ";" ")" statement;
@@ -452,8 +466,7 @@ static void parseForStatement(){
 	if (!checkToken(TOKEN_SEMICOLON)){
 		// condition clause
 		parseExpression();
-		endOfFor = emitJump(OP_JUMP_IF_FALSE);
-		emitByte(OP_POP);
+		endOfFor = emitConditionalJump();
 	} 
 
 	bodyIndex = emitJump(OP_JUMP);
@@ -463,8 +476,9 @@ static void parseForStatement(){
 
 	if (!checkToken(TOKEN_RIGHT_PAREN)){
 		// increment clause
+		int start = currentChunk()->count;
 		parseExpression();
-		emitByte(OP_POP);
+		emitExpressionPop(start);
 	}
 
 	emitByte(OP_LOOP);
@@ -479,8 +493,7 @@ static void parseForStatement(){
 	patchJump(incrementIndex, OP_LOOP);
 
 	if (endOfFor != -1) {
-		patchJump(endOfFor, OP_JUMP_IF_FALSE);
-		emitByte(OP_POP);
+		patchJump(endOfFor, OP_POP_JUMP_IF_FALSE);
 	}
 
 	endScope();
@@ -494,16 +507,14 @@ static void parseWhileStatement(){
 	parseExpression();
 	consumeToken(TOKEN_RIGHT_PAREN, "Expect ')' after while");
 
-	int endJumpIndex = emitJump(OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);
+	int endJumpIndex = emitConditionalJump();
 
 	parseStatement();
 	emitByte(OP_LOOP);
 	patchJump(conditionalIndex, OP_LOOP);
 
 	// jump back
-	patchJump(endJumpIndex, OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);
+	patchJump(endJumpIndex, OP_POP_JUMP_IF_FALSE);
 }
 
 static void parseReturnStatement(){
@@ -625,10 +636,14 @@ static void parseIdentifier(bool canAssign){
 		int upvalueIndex;
 		if ((upvalueIndex = getUpvalueDepth(currentCompiler, parser.previousToken)) == -1){
 			// Global variable
-			set_op = OP_SET_GLOBAL; 
-			get_op = OP_GET_GLOBAL; 
-			Value value = OBJECT(makeStringObject(parser.previousToken.start, parser.previousToken.length));
-			index = addConstantAndCheckLimit(value);
+			int slot = parseGlobalVariable();
+			if (canAssign && matchToken(TOKEN_EQUAL)){
+				parseExpression();
+				emitGlobalSlotInstruction(OP_SET_GLOBAL_SLOT, slot);
+			} else {
+				emitGlobalSlotInstruction(OP_GET_GLOBAL_SLOT, slot);
+			}
+			return;
 		} else {
 			// Upvalue 
 			set_op = OP_SET_UPVALUE; 
@@ -695,6 +710,10 @@ static void parseBinary(bool canAssign){
 	ParseRow* parseRow = getParseRow(type);	
 	parsePrecedence((Precedence) (parseRow->level+1));
 
+	if (type == TOKEN_EQUAL_EQUAL || type == TOKEN_BANG_EQUAL || type == TOKEN_LESS
+			|| type == TOKEN_LESS_EQUAL || type == TOKEN_GREATER || type == TOKEN_GREATER_EQUAL)
+		currentCompiler->lastComparisonIndex = currentChunk()->count;
+
 	switch (type){
 
 		case TOKEN_PLUS:
@@ -713,19 +732,19 @@ static void parseBinary(bool canAssign){
 			emitByte(OP_EQUAL); break;	
 
 		case TOKEN_BANG_EQUAL:
-			emitBytes(OP_EQUAL, OP_NOT); break;	
+			emitByte(OP_NOT_EQUAL); break;	
 
 		case TOKEN_LESS:
 			emitByte(OP_LT); break;	
 
 		case TOKEN_LESS_EQUAL:
-			emitBytes(OP_GT, OP_NOT); break;	
+			emitByte(OP_LE); break;	
 
 		case TOKEN_GREATER:
 			emitByte(OP_GT); break;	
 
 		case TOKEN_GREATER_EQUAL:
-			emitBytes(OP_LT, OP_NOT); break;	
+			emitByte(OP_GE); break;	
 
 		default:
 			break;
@@ -741,18 +760,21 @@ static void parseDot(bool canAssign){
 	if (canAssign && matchToken(TOKEN_EQUAL)){
 		parseExpression();
 		emitBytes(OP_SET_PROPERTY, index);
+		emitInlineCache();
 	} else if (matchToken(TOKEN_LEFT_PAREN)){
 		int nargs = 0;
 		if (!checkToken(TOKEN_RIGHT_PAREN))
 			nargs = parseArguments();
 		consumeToken(TOKEN_RIGHT_PAREN, "')' expected at end of function call");
-		// OP_FAST_METHOD_CALL methodNameIndex args
+		// OP_FAST_METHOD_CALL methodNameIndex args cacheIndex(2 bytes)
 		// using this instruction, we don't need to create boundMethod during runtime since it is slower and not necessary for simple cases like this as we know where the instance wil be on the stack
 		emitBytes(OP_FAST_METHOD_CALL, index);
 		emitByte(nargs);
+		emitInlineCache();
 
 	} else{
 		emitBytes(OP_GET_PROPERTY, index);
+		emitInlineCache();
 	}
 }
 
@@ -833,6 +855,69 @@ static int emitJump(uint8_t opcode){
 	return currentChunk()->count - 2;
 }
 
+// Emits a jump that pops the condition off the stack and jumps if it is falsey
+// If the condition was a comparison that was just emitted, the comparison and the jump are fused into a single compare-and-branch instruction
+static int emitConditionalJump(){
+	Chunk* chunk = currentChunk();
+	int lastIndex = chunk->count - 1;
+
+	// The comparison can't be fused if some other jump lands right after it
+	if (currentCompiler->lastComparisonIndex == lastIndex && currentCompiler->lastJumpTargetIndex != chunk->count){
+		uint8_t fusedOpcode;
+		switch (chunk->code[lastIndex]){
+			case OP_EQUAL: fusedOpcode = OP_EQUAL_JUMP_IF_FALSE; break;
+			case OP_NOT_EQUAL: fusedOpcode = OP_NOT_EQUAL_JUMP_IF_FALSE; break;
+			case OP_LT: fusedOpcode = OP_LT_JUMP_IF_FALSE; break;
+			case OP_LE: fusedOpcode = OP_LE_JUMP_IF_FALSE; break;
+			case OP_GT: fusedOpcode = OP_GT_JUMP_IF_FALSE; break;
+			case OP_GE: fusedOpcode = OP_GE_JUMP_IF_FALSE; break;
+			default: return emitJump(OP_POP_JUMP_IF_FALSE);
+		}
+
+		// drop the comparison instruction and emit the fused one in its place
+		chunk->count--;
+		currentCompiler->lastComparisonIndex = -1;
+		return emitJump(fusedOpcode);
+	}
+	return emitJump(OP_POP_JUMP_IF_FALSE);
+}
+
+// Pops the result of an expression statement that started at index `start`
+// `local = local + constant;` is fused into a single OP_INCREMENT_LOCAL instruction that doesn't touch the stack at all
+static void emitExpressionPop(int start){
+	Chunk* chunk = currentChunk();
+	uint8_t* code = chunk->code + start;
+
+	// OP_GET_LOCAL slot, OP_CONSTANT index, OP_ADD, OP_SET_LOCAL slot
+	if (chunk->count - start == 7 && code[0] == OP_GET_LOCAL && code[2] == OP_CONSTANT
+			&& code[4] == OP_ADD && code[5] == OP_SET_LOCAL && code[6] == code[1]){
+
+		uint8_t slot = code[1];
+		uint8_t constantIndex = code[3];
+
+		chunk->count = start;
+		emitBytes(OP_INCREMENT_LOCAL, slot);
+		emitByte(constantIndex);
+	} else{
+		emitByte(OP_POP);
+	}
+}
+
+// Allocates a new inline cache in the current chunk and emits its 2 byte index
+static void emitInlineCache(){
+	if (currentChunk()->cacheCount > UINT16_T_LIMIT){
+		errorAtPreviousToken("Too many property accesses in one function");
+		return;
+	}
+	int index = addInlineCache(currentChunk());
+	emitBytes(index >> 8, index & 255);
+}
+
+static void emitGlobalSlotInstruction(uint8_t opcode, int slot){
+	emitByte(opcode);
+	emitBytes(slot >> 8, slot & 255);
+}
+
 static void patchJump(int index, uint8_t opcode){
 	
 	int currentIndex = currentChunk()->count;
@@ -851,18 +936,23 @@ static void patchJump(int index, uint8_t opcode){
 		} else{
 			*(currentChunk()->code + index) = diff2;
 			*(currentChunk()->code + index + 1) = diff1;
+			currentCompiler->lastJumpTargetIndex = currentIndex;
 		}
 	}
 }
 
 static void emitConstant(Value value){
-	emitByte(OP_CONSTANT);
+	// Add the constant first, the value is not reachable by the gc until it is in the constants array
 	int index = addConstantAndCheckLimit(value);
-	emitByte((uint8_t) index);
+	emitBytes(OP_CONSTANT, (uint8_t) index);
 }
 
 static uint8_t addConstantAndCheckLimit(Value value){
+	// Push in the off chance the gc runs while the constants array grows
+	push(value);
 	int index = addConstant(currentChunk(), value);
+	pop();
+	WRITE_BARRIER(currentCompiler->function, value);
 
 	if (index > UINT8_MAX){
 		// error
@@ -957,7 +1047,15 @@ static void synchronize(){
 
 // Helper functions
 
+// Resolves the previous identifier token to its global variable slot
 static int parseGlobalVariable(){
+	ObjectString* name = makeStringObject(parser.previousToken.start, parser.previousToken.length);
+	int slot = getGlobalSlot(name);
+	if (slot > UINT16_T_LIMIT) errorAtPreviousToken("Too many global variables");
+	return slot;
+}
+
+static int identifierConstant(){
 	Value value = OBJECT(makeStringObject(parser.previousToken.start, parser.previousToken.length));
 	return addConstantAndCheckLimit(value);
 }
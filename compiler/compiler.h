@@ -37,6 +37,10 @@ typedef struct Compiler{
 
 	ObjectFunction* function;
 	FunctionType type;
+
+	// Bookkeeping for fusing instructions into superinstructions
+	int lastComparisonIndex;
+	int lastJumpTargetIndex;
 } Compiler;
 
 typedef struct CompilingClass{
@@ -5,6 +5,8 @@
 static void handleConstantInstruction(Chunk*,int,bool);
 static void handleByteInstruction(Chunk*,int);
 static void handleJumpInstruction(uint8_t, Chunk*,int);
+static void handleInlineCacheInstruction(Chunk*,int);
+static void handleGlobalSlotInstruction(Chunk*,int);
 static int handleClosureUpvalues(Chunk*,int,int);
 
 void disassembleChunk(Chunk* chunk, char name[]){
@@ -34,19 +36,19 @@ int disassembleInstruction(Chunk* chunk, int index){
 			handleConstantInstruction(chunk, ++index, true);
 			break;
 
-		case OP_DEFINE_GLOBAL:
-			printf("OP_DEFINE_GLOBAL\t");
-			handleConstantInstruction(chunk, ++index, true);
+		case OP_DEFINE_GLOBAL_SLOT:
+			printf("OP_DEFINE_GLOBAL_SLOT\t");
+			handleGlobalSlotInstruction(chunk, index = index + 2);
 			break;
 
-		case OP_GET_GLOBAL:
-			printf("OP_GET_GLOBAL\t");
-			handleConstantInstruction(chunk, ++index, true);
+		case OP_GET_GLOBAL_SLOT:
+			printf("OP_GET_GLOBAL_SLOT\t");
+			handleGlobalSlotInstruction(chunk, index = index + 2);
 			break;
 
-		case OP_SET_GLOBAL:
-			printf("OP_SET_GLOBAL\t");
-			handleConstantInstruction(chunk, ++index, true);
+		case OP_SET_GLOBAL_SLOT:
+			printf("OP_SET_GLOBAL_SLOT\t");
+			handleGlobalSlotInstruction(chunk, index = index + 2);
 			break;
 
 		case OP_GET_LOCAL:
@@ -137,7 +139,8 @@ int disassembleInstruction(Chunk* chunk, int index){
 		case OP_JUMP_IF_TRUE:
 			printf("OP_JUMP_IF_TRUE\t");
 			handleJumpInstruction(OP_JUMP_IF_TRUE, chunk, index = index + 2);
-		
+			break;
+
 		case OP_LOOP:
 			printf("OP_LOOP\t");
 			handleJumpInstruction(OP_LOOP, chunk, index = index + 2);
@@ -172,18 +175,21 @@ int disassembleInstruction(Chunk* chunk, int index){
 
 		case OP_GET_PROPERTY:
 			printf("OP_GET_PROPERTY\t");
-			handleConstantInstruction(chunk, ++index, true);
+			handleConstantInstruction(chunk, ++index, false);
+			handleInlineCacheInstruction(chunk, index = index + 2);
 			break;
 
 		case OP_SET_PROPERTY:
 			printf("OP_SET_PROPERTY\t");
-			handleConstantInstruction(chunk, ++index, true);
+			handleConstantInstruction(chunk, ++index, false);
+			handleInlineCacheInstruction(chunk, index = index + 2);
 			break;
 
 		case OP_FAST_METHOD_CALL:
 			printf("OP_FAST_METHOD_CALL\t");
 			handleConstantInstruction(chunk, ++index, false);
-			handleByteInstruction(chunk, ++index);
+			printf("\t%d args", *((chunk->code)+(++index)));
+			handleInlineCacheInstruction(chunk, index = index + 2);
 			break;
 
 		case OP_INHERIT_SUPERCLASS:
@@ -205,6 +211,95 @@ int disassembleInstruction(Chunk* chunk, int index){
 			handleByteInstruction(chunk, ++index);
 			break;
 
+		case OP_NOT_EQUAL:
+			printf("OP_NOT_EQUAL\n");
+			break;
+
+		case OP_LE:
+			printf("OP_LE\n");
+			break;
+
+		case OP_GE:
+			printf("OP_GE\n");
+			break;
+
+		case OP_POP_JUMP_IF_FALSE:
+			printf("OP_POP_JUMP_IF_FALSE\t");
+			handleJumpInstruction(OP_POP_JUMP_IF_FALSE, chunk, index = index + 2);
+			break;
+
+		case OP_EQUAL_JUMP_IF_FALSE:
+			printf("OP_EQUAL_JUMP_IF_FALSE\t");
+			handleJumpInstruction(OP_EQUAL_JUMP_IF_FALSE, chunk, index = index + 2);
+			break;
+
+		case OP_NOT_EQUAL_JUMP_IF_FALSE:
+			printf("OP_NOT_EQUAL_JUMP_IF_FALSE\t");
+			handleJumpInstruction(OP_NOT_EQUAL_JUMP_IF_FALSE, chunk, index = index + 2);
+			break;
+
+		case OP_LT_JUMP_IF_FALSE:
+			printf("OP_LT_JUMP_IF_FALSE\t");
+			handleJumpInstruction(OP_LT_JUMP_IF_FALSE, chunk, index = index + 2);
+			break;
+
+		case OP_LE_JUMP_IF_FALSE:
+			printf("OP_LE_JUMP_IF_FALSE\t");
+			handleJumpInstruction(OP_LE_JUMP_IF_FALSE, chunk, index = index + 2);
+			break;
+
+		case OP_GT_JUMP_IF_FALSE:
+			printf("OP_GT_JUMP_IF_FALSE\t");
+			handleJumpInstruction(OP_GT_JUMP_IF_FALSE, chunk, index = index + 2);
+			break;
+
+		case OP_GE_JUMP_IF_FALSE:
+			printf("OP_GE_JUMP_IF_FALSE\t");
+			handleJumpInstruction(OP_GE_JUMP_IF_FALSE, chunk, index = index + 2);
+			break;
+
+		case OP_INCREMENT_LOCAL:
+			printf("OP_INCREMENT_LOCAL\t");
+			printf("%4d\t", *((chunk->code)+(++index)));
+			handleConstantInstruction(chunk, ++index, true);
+			break;
+
+		case OP_ADD_NUM_NUM:
+			printf("OP_ADD_NUM_NUM\n");
+			break;
+
+		case OP_ADD_STR_STR:
+			printf("OP_ADD_STR_STR\n");
+			break;
+
+		case OP_SUBTRACT_NUM_NUM:
+			printf("OP_SUBTRACT_NUM_NUM\n");
+			break;
+
+		case OP_MULTIPLY_NUM_NUM:
+			printf("OP_MULTIPLY_NUM_NUM\n");
+			break;
+
+		case OP_DIVIDE_NUM_NUM:
+			printf("OP_DIVIDE_NUM_NUM\n");
+			break;
+
+		case OP_GT_NUM_NUM:
+			printf("OP_GT_NUM_NUM\n");
+			break;
+
+		case OP_LT_NUM_NUM:
+			printf("OP_LT_NUM_NUM\n");
+			break;
+
+		case OP_LE_NUM_NUM:
+			printf("OP_LE_NUM_NUM\n");
+			break;
+
+		case OP_GE_NUM_NUM:
+			printf("OP_GE_NUM_NUM\n");
+			break;
+
 		default:
 			printf("UNKNOWN_OP_CODE\n");
 			break;
@@ -244,6 +339,21 @@ static void handleJumpInstruction(uint8_t opcode, Chunk* chunk, int index){
 	disassembleInstruction(chunk, index);
 }
 
+static void handleInlineCacheInstruction(Chunk* chunk, int index){
+	uint16_t cacheIndex = (uint16_t) *(chunk->code + (index-1));
+	cacheIndex = (cacheIndex << 8) + *(chunk->code + index);
+	printf("\tcache %d\n", cacheIndex);
+}
+
+static void handleGlobalSlotInstruction(Chunk* chunk, int index){
+	extern VM vm;
+	uint16_t slot = (uint16_t) *(chunk->code + (index-1));
+	slot = (slot << 8) + *(chunk->code + index);
+	printf("%4d ", slot);
+	printValue(vm.globalNames.values[slot]);
+	printf("\n");
+}
+
 static int handleClosureUpvalues(Chunk* chunk, int currentIndex, int upvalueCount){
 	for (int i=0; i< upvalueCount; i++){
 
@@ -0,0 +1,441 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heapsummary.h"
+
+// Rows of the report
+#define SUMMARY_GROUPS 30
+#define SUMMARY_STRINGS 10
+
+typedef struct{
+	uint64_t address;
+	size_t size;
+	int group;
+	// Only kept for strings
+	char* label;
+	int firstEdge;
+	int edgeCount;
+} Node;
+
+// Instances are grouped by class, the other objects by type
+typedef struct{
+	char* name;
+	int objects;
+	size_t size;
+	size_t retained;
+} Group;
+
+static Node* nodes;
+static int nodeCount;
+static int nodeCapacity;
+
+// Addresses of the references of every node, then the indexes of their nodes once every node was read
+static uint64_t* edges;
+static int edgeCount;
+static int edgeCapacity;
+
+static uint64_t* roots;
+static int rootCount;
+static int rootCapacity;
+
+static Group* groups;
+static int groupCount;
+static int groupCapacity;
+
+#define APPEND(array, count, capacity, value) \
+		do { \
+			if ((count) + 1 > (capacity)){ \
+				(capacity) = (capacity) < 8 ? 8 : (capacity) * 2; \
+				(array) = realloc((array), sizeof(*(array)) * (capacity)); \
+				if ((array) == NULL) exit(1); \
+			} \
+			(array)[(count)++] = (value); \
+		} while (false)
+
+static void* allocateArray(size_t count, size_t size){
+	void* array = calloc(count == 0 ? 1 : count, size);
+	if (array == NULL) exit(1);
+	return array;
+}
+
+// Few groups: a linear search is enough
+static int findGroup(const char* name){
+	for (int i=0; i < groupCount; i++){
+		if (strcmp(groups[i].name, name) == 0) return i;
+	}
+	Group group = {strdup(name), 0, 0, 0};
+	APPEND(groups, groupCount, groupCapacity, group);
+	return groupCount - 1;
+}
+
+// Splits the line at its tabs, returns how many fields there are
+static int splitFields(char* line, char** fields, int maxFields){
+	int count = 0;
+	fields[count++] = line;
+	for (char* c = line; *c != '\0'; c++){
+		if (*c == '\n'){
+			*c = '\0';
+			break;
+		}
+		if (*c == '\t' && count < maxFields){
+			*c = '\0';
+			fields[count++] = c + 1;
+		}
+	}
+	return count;
+}
+
+static bool readObject(char** fields){
+	Node node;
+	char* end;
+	node.address = strtoull(fields[1], &end, 16);
+	if (*end != '\0') return false;
+	node.size = strtoull(fields[3], &end, 10);
+	if (*end != '\0') return false;
+	node.label = NULL;
+
+	if (strcmp(fields[2], "instance") == 0){
+		node.group = findGroup(fields[4]);
+	} else{
+		char name[64];
+		snprintf(name, sizeof(name), "(%s)", fields[2]);
+		node.group = findGroup(name);
+		if (strcmp(fields[2], "string") == 0) node.label = strdup(fields[4]);
+	}
+
+	node.firstEdge = edgeCount;
+	for (char* reference = fields[5]; *reference != '\0'; reference = end){
+		uint64_t address = strtoull(reference, &end, 16);
+		if (end == reference) return false;
+		APPEND(edges, edgeCount, edgeCapacity, address);
+		while (*end == ' ') end++;
+	}
+	node.edgeCount = edgeCount - node.firstEdge;
+
+	APPEND(nodes, nodeCount, nodeCapacity, node);
+	return true;
+}
+
+static bool readSnapshot(const char* path){
+	FILE* file = fopen(path, "r");
+	if (file == NULL) return false;
+
+	char* line = NULL;
+	size_t lineSize = 0;
+	int lineNumber = 0;
+	bool isValid = true;
+	while (isValid && getline(&line, &lineSize, file) != -1){
+		lineNumber++;
+		if (line[0] == '#') continue;
+
+		char* fields[6];
+		int count = splitFields(line, fields, 6);
+		if (count == 3 && strcmp(fields[0], "root") == 0){
+			char* end;
+			uint64_t address = strtoull(fields[2], &end, 16);
+			isValid = *end == '\0';
+			APPEND(roots, rootCount, rootCapacity, address);
+		} else if (count == 6 && strcmp(fields[0], "object") == 0){
+			isValid = readObject(fields);
+		} else{
+			isValid = false;
+		}
+	}
+	if (!isValid) fprintf(stderr, "Invalid heap snapshot line %d : %s\n", lineNumber, path);
+
+	free(line);
+	fclose(file);
+	return isValid;
+}
+
+// Open addressing map from addresses to node indexes
+static int* addressMap;
+static int addressMapCapacity;
+
+static int findAddressSlot(uint64_t address){
+	int index = (int) (((address >> 3) * 0x9E3779B97F4A7C15ull) >> 32) & (addressMapCapacity - 1);
+	while (addressMap[index] != -1 && nodes[addressMap[index]].address != address){
+		index = (index + 1) & (addressMapCapacity - 1);
+	}
+	return index;
+}
+
+// Returns the index of the node at `address`, -1 if the snapshot has none
+static int findNode(uint64_t address){
+	return addressMap[findAddressSlot(address)];
+}
+
+static void mapAddresses(){
+	addressMapCapacity = 16;
+	while (addressMapCapacity < nodeCount * 2) addressMapCapacity *= 2;
+	addressMap = (int*) allocateArray(addressMapCapacity, sizeof(int));
+	memset(addressMap, -1, sizeof(int) * addressMapCapacity);
+	for (int i=0; i < nodeCount; i++){
+		addressMap[findAddressSlot(nodes[i].address)] = i;
+	}
+}
+
+// The graph: successors and predecessors of every node, with a virtual root (index nodeCount) pointing to the roots
+static int* successorStart;
+static int* successors;
+static int* predecessorStart;
+static int* predecessors;
+
+static void buildGraph(){
+	int root = nodeCount;
+	successorStart = (int*) allocateArray(nodeCount + 2, sizeof(int));
+	successors = (int*) allocateArray(edgeCount + rootCount, sizeof(int));
+
+	int count = 0;
+	for (int i=0; i < nodeCount; i++){
+		successorStart[i] = count;
+		for (int j=0; j < nodes[i].edgeCount; j++){
+			int target = findNode(edges[nodes[i].firstEdge + j]);
+			if (target != -1) successors[count++] = target;
+		}
+	}
+	successorStart[root] = count;
+	for (int i=0; i < rootCount; i++){
+		int target = findNode(roots[i]);
+		if (target != -1) successors[count++] = target;
+	}
+	successorStart[root + 1] = count;
+
+	predecessorStart = (int*) allocateArray(nodeCount + 2, sizeof(int));
+	predecessors = (int*) allocateArray(count, sizeof(int));
+	for (int i=0; i < count; i++){
+		predecessorStart[successors[i] + 1]++;
+	}
+	for (int i=0; i <= root; i++){
+		predecessorStart[i + 1] += predecessorStart[i];
+	}
+	int* filled = (int*) allocateArray(nodeCount + 1, sizeof(int));
+	for (int i=0; i <= root; i++){
+		for (int j=successorStart[i]; j < successorStart[i + 1]; j++){
+			int target = successors[j];
+			predecessors[predecessorStart[target] + filled[target]++] = i;
+		}
+	}
+	free(filled);
+}
+
+// Depth first numbering from the virtual root: `postorder` numbers every node reached (-1 for the others),
+// and `order` lists them in reverse postorder. Returns how many nodes were reached
+static int numberNodes(int* postorder, int* order){
+	int root = nodeCount;
+	int* stack = (int*) allocateArray(nodeCount + 1, sizeof(int));
+	int* nextEdge = (int*) allocateArray(nodeCount + 1, sizeof(int));
+	bool* isReached = (bool*) allocateArray(nodeCount + 1, sizeof(bool));
+
+	int count = 0;
+	int top = 0;
+	stack[top++] = root;
+	isReached[root] = true;
+	nextEdge[root] = successorStart[root];
+	while (top > 0){
+		int node = stack[top - 1];
+		if (nextEdge[node] < successorStart[node + 1]){
+			int next = successors[nextEdge[node]++];
+			if (!isReached[next]){
+				isReached[next] = true;
+				nextEdge[next] = successorStart[next];
+				stack[top++] = next;
+			}
+		} else{
+			top--;
+			postorder[node] = count++;
+		}
+	}
+
+	for (int i=0; i <= root; i++){
+		if (!isReached[i]) postorder[i] = -1;
+		else order[count - 1 - postorder[i]] = i;
+	}
+
+	free(stack);
+	free(nextEdge);
+	free(isReached);
+	return count;
+}
+
+static int intersect(int* dominators, int* postorder, int a, int b){
+	while (a != b){
+		while (postorder[a] < postorder[b]) a = dominators[a];
+		while (postorder[b] < postorder[a]) b = dominators[b];
+	}
+	return a;
+}
+
+// Immediate dominator of every node reached, with the iterative algorithm of Cooper, Harvey and Kennedy
+static int* findDominators(int* postorder, int* order, int reached){
+	int root = nodeCount;
+	int* dominators = (int*) allocateArray(nodeCount + 1, sizeof(int));
+	for (int i=0; i <= root; i++){
+		dominators[i] = -1;
+	}
+	dominators[root] = root;
+
+	bool isChanged = true;
+	while (isChanged){
+		isChanged = false;
+		// order[0] is the root
+		for (int i=1; i < reached; i++){
+			int node = order[i];
+			int dominator = -1;
+			for (int j=predecessorStart[node]; j < predecessorStart[node + 1]; j++){
+				int predecessor = predecessors[j];
+				if (dominators[predecessor] == -1) continue;
+				dominator = dominator == -1 ? predecessor : intersect(dominators, postorder, predecessor, dominator);
+			}
+			if (dominators[node] != dominator){
+				dominators[node] = dominator;
+				isChanged = true;
+			}
+		}
+	}
+	return dominators;
+}
+
+// Adds the retained size of every node to its group, unless an instance of the same group dominates it (its size is already counted then)
+// Walks the dominator tree depth first, keeping count of the nodes of every group on the path from the root
+static void retainGroups(int* dominators, int* order, int reached, size_t* retained){
+	int root = nodeCount;
+	int* childStart = (int*) allocateArray(nodeCount + 2, sizeof(int));
+	int* children = (int*) allocateArray(reached, sizeof(int));
+	for (int i=1; i < reached; i++){
+		childStart[dominators[order[i]] + 1]++;
+	}
+	for (int i=0; i <= root; i++){
+		childStart[i + 1] += childStart[i];
+	}
+	int* filled = (int*) allocateArray(nodeCount + 1, sizeof(int));
+	for (int i=1; i < reached; i++){
+		int parent = dominators[order[i]];
+		children[childStart[parent] + filled[parent]++] = order[i];
+	}
+	free(filled);
+
+	int* onPath = (int*) allocateArray(groupCount, sizeof(int));
+	// Nodes to enter, and the complement (~node) of the nodes to leave
+	int* stack = (int*) allocateArray(2 * (reached + 1), sizeof(int));
+	int top = 0;
+	for (int i=childStart[root]; i < childStart[root + 1]; i++){
+		stack[top++] = children[i];
+	}
+	while (top > 0){
+		int node = stack[--top];
+		if (node < 0){
+			onPath[nodes[~node].group]--;
+			continue;
+		}
+
+		Group* group = groups + nodes[node].group;
+		group->objects++;
+		group->size += nodes[node].size;
+		if (onPath[nodes[node].group]++ == 0) group->retained += retained[node];
+
+		stack[top++] = ~node;
+		for (int i=childStart[node]; i < childStart[node + 1]; i++){
+			stack[top++] = children[i];
+		}
+	}
+
+	free(onPath);
+	free(stack);
+	free(childStart);
+	free(children);
+}
+
+static int compareGroups(const void* a, const void* b){
+	size_t retainedA = ((const Group*) a)->retained, retainedB = ((const Group*) b)->retained;
+	return (retainedA < retainedB) - (retainedA > retainedB);
+}
+
+static int compareStringSizes(const void* a, const void* b){
+	size_t sizeA = nodes[*(const int*) a].size, sizeB = nodes[*(const int*) b].size;
+	return (sizeA < sizeB) - (sizeA > sizeB);
+}
+
+static void printSummary(size_t* retained, int reached){
+	size_t total = retained[nodeCount];
+	printf("heap snapshot: %d objects, %zu bytes, %d roots\n", reached - 1, total, rootCount);
+
+	qsort(groups, groupCount, sizeof(Group), compareGroups);
+	printf("\n%-32s %10s %14s %14s %7s\n", "retained by", "objects", "size", "retained", "heap");
+	for (int i=0; i < groupCount && i < SUMMARY_GROUPS; i++){
+		Group* group = groups + i;
+		if (group->objects == 0) continue;
+		printf("%-32s %10d %14zu %14zu %6.1f%%\n", group->name, group->objects, group->size, group->retained,
+				total == 0 ? 0 : 100.0 * group->retained / total);
+	}
+
+	int* strings = (int*) allocateArray(nodeCount, sizeof(int));
+	int stringCount = 0;
+	for (int i=0; i < nodeCount; i++){
+		if (nodes[i].label != NULL) strings[stringCount++] = i;
+	}
+	qsort(strings, stringCount, sizeof(int), compareStringSizes);
+	printf("\nlargest strings\n");
+	for (int i=0; i < stringCount && i < SUMMARY_STRINGS; i++){
+		printf("%14zu \"%s\"\n", nodes[strings[i]].size, nodes[strings[i]].label);
+	}
+	free(strings);
+}
+
+static void freeSummary(){
+	for (int i=0; i < nodeCount; i++){
+		free(nodes[i].label);
+	}
+	for (int i=0; i < groupCount; i++){
+		free(groups[i].name);
+	}
+	free(nodes);
+	free(edges);
+	free(roots);
+	free(groups);
+	free(addressMap);
+	free(successorStart);
+	free(successors);
+	free(predecessorStart);
+	free(predecessors);
+	nodes = NULL;
+	edges = NULL;
+	roots = NULL;
+	groups = NULL;
+	addressMap = NULL;
+	nodeCount = nodeCapacity = edgeCount = edgeCapacity = rootCount = rootCapacity = groupCount = groupCapacity = 0;
+}
+
+// Returns false if the snapshot could not be read
+bool summarizeHeapSnapshot(const char* path){
+	if (!readSnapshot(path)){
+		freeSummary();
+		return false;
+	}
+	mapAddresses();
+	buildGraph();
+
+	int* postorder = (int*) allocateArray(nodeCount + 1, sizeof(int));
+	int* order = (int*) allocateArray(nodeCount + 1, sizeof(int));
+	int reached = numberNodes(postorder, order);
+	int* dominators = findDominators(postorder, order, reached);
+
+	// Children come after their dominator in reverse postorder, so going backwards adds up every subtree before its root
+	size_t* retained = (size_t*) allocateArray(nodeCount + 1, sizeof(size_t));
+	for (int i=0; i < nodeCount; i++){
+		retained[i] = nodes[i].size;
+	}
+	for (int i=reached - 1; i > 0; i--){
+		retained[dominators[order[i]]] += retained[order[i]];
+	}
+	retainGroups(dominators, order, reached, retained);
+	printSummary(retained, reached);
+
+	free(postorder);
+	free(order);
+	free(dominators);
+	free(retained);
+	freeSummary();
+	return true;
+}
@@ -0,0 +1,13 @@
+#ifndef HEAP_SUMMARY_H
+#define HEAP_SUMMARY_H
+
+#include "../common.h"
+
+// Summary of a heap snapshot (see "vm/snapshot.h"): what every class retains, and the largest strings
+// The retained size of an object is what would be freed with it: its own size and the size of every object only reachable through it
+// (the objects it dominates in the object graph). A class retains what its instances retain, instances of the class they retain counted once
+
+// function prototypes
+bool summarizeHeapSnapshot(const char* path);
+
+#endif
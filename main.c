@@ -1,33 +1,157 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include "vm/vm.h"
+#include "vm/snapshot.h"
+#include "debug/heapsummary.h"
 
 #define DEBUG_CHUNK
 
+extern VM vm;
+
 // function prototypes
+static void printUsage();
+static bool setGCOption(char*, char*);
+static bool parseSize(char*, int64_t*);
+static void readGCEnvironment();
 static void runREPL();
-static void runFile(char*);
+static int runFile(char*);
 static char* readFile(char*);
 
 int main(int nargs, char * args[]){
 	initVM(false);
+	readGCEnvironment();
+
+	char* path = NULL;
+	bool printStats = false;
+	char* snapshotPath = NULL;
+	char* profilePath = NULL;
+	int64_t sampleInterval = ALLOCATION_SAMPLE_INTERVAL;
+	for (int i=1; i < nargs; i++){
+		char* value = strchr(args[i], '=');
+		if (strncmp(args[i], "--gc-", 5) == 0 && value != NULL && setGCOption(args[i] + 5, value + 1)){
+			continue;
+		} else if (strncmp(args[i], "--gc-threads=", 13) == 0){
+			int threads = atoi(args[i] + 13);
+			if (threads < 1 || threads > GC_MAX_MARK_THREADS) printUsage();
+			vm.gc.markThreads = threads;
+		} else if (strcmp(args[i], "--gc-compact=never") == 0){
+			vm.gc.compactMode = COMPACT_NEVER;
+		} else if (strcmp(args[i], "--gc-compact=fragmented") == 0){
+			vm.gc.compactMode = COMPACT_WHEN_FRAGMENTED;
+		} else if (strcmp(args[i], "--gc-compact=always") == 0){
+			vm.gc.compactMode = COMPACT_ALWAYS;
+		} else if (strcmp(args[i], "--gc-stats") == 0){
+			printStats = true;
+		} else if (strncmp(args[i], "--heap-snapshot=", 16) == 0){
+			snapshotPath = args[i] + 16;
+		} else if (strncmp(args[i], "--alloc-profile=", 16) == 0){
+			profilePath = args[i] + 16;
+		} else if (strncmp(args[i], "--alloc-sample=", 15) == 0){
+			if (!parseSize(args[i] + 15, &sampleInterval) || sampleInterval < 1) printUsage();
+		} else if (strncmp(args[i], "--heap-summary=", 15) == 0){
+			// Summarizes a snapshot written earlier instead of running anything
+			if (!summarizeHeapSnapshot(args[i] + 15)){
+				fprintf(stderr, "Unable to read heap snapshot : %s\n", args[i] + 15);
+				exit(74);
+			}
+			freeVM();
+			return 0;
+		} else if (path == NULL && strncmp(args[i], "--", 2) != 0){
+			path = args[i];
+		} else {
+			printUsage();
+		}
+	}
+	// The first gc run was scheduled before the options could change it
+	scheduleGC(vm.gc.initialTrigger);
+	if (profilePath != NULL) startProfiler(sampleInterval);
 
-	if (nargs == 1){
+	int status = 0;
+	if (path == NULL){
 		// REPL
 		runREPL();
 
-	} else if (nargs == 2){
-		// Run a file
-		runFile(*(args+1));
-
 	} else {
-		printf("Usage: clox [path]\n");
-		exit(49);
+		// Run a file
+		status = runFile(path);
 	}
+	if (snapshotPath != NULL && !writeHeapSnapshot(snapshotPath)) fprintf(stderr, "Unable to write heap snapshot : %s\n", snapshotPath);
+	if (profilePath != NULL && !writeAllocationProfile(profilePath)) fprintf(stderr, "Unable to write allocation profile : %s\n", profilePath);
+	if (printStats) printGCStats();
 	freeVM();
-	return 0;
+	return status;
+}
+
+static void printUsage(){
+	printf("Usage: clox [--gc-threads=N] [--gc-compact=never|fragmented|always] [--gc-stats]\n");
+	printf("            [--gc-initial=SIZE] [--gc-growth=FACTOR] [--gc-min-heap=SIZE] [--gc-max-heap=SIZE] [path]\n");
+	printf("            [--heap-snapshot=FILE] [--heap-summary=FILE] [--alloc-profile=FILE] [--alloc-sample=SIZE]\n");
+	printf("--heap-snapshot writes a snapshot of the heap to FILE at exit, --heap-summary summarizes one instead of running a program\n");
+	printf("--alloc-profile samples an allocation every --alloc-sample bytes (256K by default), ranks the allocation sites on stderr at exit\n");
+	printf("and writes the sampled call stacks to FILE, folded for flamegraph.pl\n");
+	printf("SIZE is in bytes, or followed by K, M or G. --gc-max-heap=0 removes the heap limit\n");
+	printf("The CLOX_GC_INITIAL, CLOX_GC_GROWTH, CLOX_GC_MIN_HEAP and CLOX_GC_MAX_HEAP environment variables set the same values, the options override them\n");
+	exit(49);
+}
+
+// Parses a number of bytes, with an optional K, M or G suffix
+static bool parseSize(char* text, int64_t* size){
+	char* end;
+	errno = 0;
+	long long value = strtoll(text, &end, 10);
+	if (end == text || value < 0 || errno == ERANGE) return false;
+
+	int shift = 0;
+	switch (*end){
+		case 'K': case 'k': shift = 10; end++; break;
+		case 'M': case 'm': shift = 20; end++; break;
+		case 'G': case 'g': shift = 30; end++; break;
+	}
+	if (*end != '\0' || value > (INT64_MAX >> shift)) return false;
+	value <<= shift;
+
+	*size = value;
+	return true;
+}
+
+// Sets the gc tunable `name` (initial, growth, min-heap or max-heap) to `value`, returns false if either is not valid
+static bool setGCOption(char* name, char* value){
+	// Names from the command line are still followed by their value
+	size_t length = strcspn(name, "=");
+
+	if (length == 7 && strncmp(name, "initial", 7) == 0) return parseSize(value, &vm.gc.initialTrigger);
+	if (length == 8 && strncmp(name, "min-heap", 8) == 0) return parseSize(value, &vm.gc.minHeap);
+	if (length == 8 && strncmp(name, "max-heap", 8) == 0) return parseSize(value, &vm.gc.heapLimit);
+	if (length == 6 && strncmp(name, "growth", 6) == 0){
+		char* end;
+		double factor = strtod(value, &end);
+		// The heap has to be allowed to grow past what survived a gc, or every allocation would run one
+		if (end == value || *end != '\0' || !(factor > 1.0)) return false;
+		vm.gc.growthFactor = factor;
+		return true;
+	}
+	return false;
+}
+
+static void readGCEnvironment(){
+	static char* variables[][2] = {
+		{"CLOX_GC_INITIAL", "initial"},
+		{"CLOX_GC_GROWTH", "growth"},
+		{"CLOX_GC_MIN_HEAP", "min-heap"},
+		{"CLOX_GC_MAX_HEAP", "max-heap"},
+	};
+
+	for (size_t i=0; i < sizeof(variables) / sizeof(variables[0]); i++){
+		char* value = getenv(variables[i][0]);
+		if (value == NULL) continue;
+		if (!setGCOption(variables[i][1], value)){
+			fprintf(stderr, "Invalid value for %s : %s\n", variables[i][0], value);
+			exit(49);
+		}
+	}
 }
 
 
@@ -52,13 +176,15 @@ static void runREPL(){
 	}
 }
 
-static void runFile(char* fileName){
+// Returns the exit status
+static int runFile(char* fileName){
 	char * fileSource;
 	fileSource = readFile(fileName);
 	InterpreterResult result = interpret(fileSource);
 	free(fileSource);
-	if (result == COMPILE_ERROR) exit(65);
-	if (result == RUNTIME_ERROR) exit(70);
+	if (result == COMPILE_ERROR) return 65;
+	if (result == RUNTIME_ERROR) return 70;
+	return 0;
 }
 
 
@@ -9,6 +9,9 @@ void initChunk(Chunk* chunk){
 	chunk->code = NULL;
 	chunk->lines = NULL;
 	initValueArray(&(chunk->constants));
+	chunk->cacheCount = 0;
+	chunk->cacheCapacity = 0;
+	chunk->caches = NULL;
 }
 
 void addCode(Chunk* chunk, uint8_t byte, int line){
@@ -32,11 +35,29 @@ int addConstant(Chunk* chunk, Value constant){
 	return (chunk->constants).count - 1;
 }
 
+int addInlineCache(Chunk* chunk){
+	if (chunk->cacheCount == chunk->cacheCapacity){
+		int old_capacity = chunk->cacheCapacity;
+		chunk->cacheCapacity = GROW_CAPACITY(chunk->cacheCapacity);
+		chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, old_capacity, chunk->cacheCapacity);
+	}
+
+	InlineCache* cache = chunk->caches + chunk->cacheCount;
+	cache->Class = NULL;
+	cache->classVersion = 0;
+	cache->method = NULL;
+	cache->shape = NULL;
+	cache->newShape = NULL;
+	cache->slot = 0;
+	return chunk->cacheCount++;
+}
+
 void freeChunk(Chunk* chunk){
 
 	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
 	FREE_ARRAY(int, chunk->lines, chunk->capacity);
 	freeValueArray(&(chunk->constants));
+	FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
 	initChunk(chunk);
 }
 
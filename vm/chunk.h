@@ -23,9 +23,10 @@ typedef enum {
 	OP_POP,
 	OP_POP_UPVALUE,
 	OP_PRINT,
-	OP_DEFINE_GLOBAL,
-	OP_GET_GLOBAL,
-	OP_SET_GLOBAL,
+	// Globals are resolved at compile time to a 2 byte slot index in `vm.globalValues`
+	OP_DEFINE_GLOBAL_SLOT,
+	OP_GET_GLOBAL_SLOT,
+	OP_SET_GLOBAL_SLOT,
 	OP_GET_LOCAL,
 	OP_SET_LOCAL,
 	OP_GET_UPVALUE,
@@ -47,15 +48,58 @@ typedef enum {
 	OP_STACK_SWAP,
 	OP_GET_SUPER,
 	OP_FAST_SUPER_METHOD_CALL,
+
+	// Superinstructions: fused versions of sequences the compiler emits all the time
+	OP_NOT_EQUAL,
+	OP_LE,
+	OP_GE,
+	OP_POP_JUMP_IF_FALSE,
+	OP_EQUAL_JUMP_IF_FALSE,
+	OP_NOT_EQUAL_JUMP_IF_FALSE,
+	OP_LT_JUMP_IF_FALSE,
+	OP_LE_JUMP_IF_FALSE,
+	OP_GT_JUMP_IF_FALSE,
+	OP_GE_JUMP_IF_FALSE,
+	OP_INCREMENT_LOCAL,
+
+	// Quickened opcodes: never emitted by the compiler, the VM rewrites a generic arithmetic/comparison opcode in place
+	// into one of these once it has seen the operand types at that site, and rewrites it back if the guard ever fails
+	OP_ADD_NUM_NUM,
+	OP_ADD_STR_STR,
+	OP_SUBTRACT_NUM_NUM,
+	OP_MULTIPLY_NUM_NUM,
+	OP_DIVIDE_NUM_NUM,
+	OP_GT_NUM_NUM,
+	OP_LT_NUM_NUM,
+	OP_LE_NUM_NUM,
+	OP_GE_NUM_NUM,
 } OPCode;
 
 // Struct
+
+// Inline cache for OP_GET_PROPERTY, OP_SET_PROPERTY and OP_FAST_METHOD_CALL, one per instruction
+// The instruction refers to its cache with a 2 byte index operand
+typedef struct InlineCache{
+	// Method that `Class` resolved the property to, valid as long as the class version has not changed
+	ObjectClass* Class;
+	uint32_t classVersion;
+	ObjectClosure* method;
+	// Instances with this shape keep the field in `slot`
+	// For OP_SET_PROPERTY, `newShape` is the shape after the store (a different one if the store added the field)
+	struct Shape* shape;
+	struct Shape* newShape;
+	int slot;
+} InlineCache;
+
 typedef struct Chunk{
 	int capacity;
 	int count;
 	uint8_t *code;		
 	int *lines;		
 	ValueArray constants;
+	int cacheCount;
+	int cacheCapacity;
+	InlineCache* caches;
 } Chunk;
 
 // function prototypes
@@ -63,5 +107,6 @@ void initChunk(Chunk*);
 void freeChunk(Chunk*);
 void addCode(Chunk*, uint8_t, int);
 int addConstant(Chunk*, Value);
+int addInlineCache(Chunk*);
 
 #endif
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "compactor.h"
+#include "memory.h"
+#include "vm.h"
+#include "shape.h"
+#include "../compiler/compiler.h"
+
+extern VM vm;
+
+// Returns where the object was moved to, or the object itself if it did not move
+static Object* forward(Object* object){
+	if (object == NULL || !object->isForwarded) return object;
+	return FORWARDING_ADDRESS(object);
+}
+
+static void forwardValue(Value* value){
+	if (IS_OBJ(*value)) *value = OBJECT(forward(AS_OBJ(*value)));
+}
+
+// Keys keep their hash when they move, so the entries stay where they are
+static void forwardTable(Table* table){
+	for (int i=0; i < table->capacity; i++){
+		if (TABLE_KEY(table, i) == NULL) continue;
+		TABLE_KEY(table, i) = (ObjectString*) forward((Object*) TABLE_KEY(table, i));
+		forwardValue(&TABLE_VALUE(table, i));
+	}
+}
+
+static void forwardShapeTree(Shape* shape){
+	shape->key = (ObjectString*) forward((Object*) shape->key);
+	for (Shape* child = shape->firstChild; child != NULL; child = child->nextSibling){
+		forwardShapeTree(child);
+	}
+}
+
+static void forwardRoots(){
+	vm.init = (ObjectString*) forward((Object*) vm.init);
+
+	for (int i=0; i < vm.selectorNames.count; i++){
+		forwardValue(vm.selectorNames.values + i);
+	}
+
+	forwardTable(&vm.globalSlots);
+	for (int i=0; i < vm.globalValues.count; i++){
+		forwardValue(vm.globalValues.values + i);
+	}
+	for (int i=0; i < vm.globalNames.count; i++){
+		forwardValue(vm.globalNames.values + i);
+	}
+
+	for (Value* slot = vm.stack; slot < vm.stackpointer; slot++){
+		forwardValue(slot);
+	}
+	for (int i=0; i < vm.frameCount; i++){
+		vm.frames[i].closure = (ObjectClosure*) forward((Object*) vm.frames[i].closure);
+	}
+	for (int i=0; i < STACK_MAX_SIZE; i++){
+		vm.openObjUpvalues[i] = (ObjectUpvalue*) forward((Object*) vm.openObjUpvalues[i]);
+	}
+
+	// Weak references: the interned strings and the remembered set
+	forwardTable(&vm.strings);
+	#ifdef GENERATIONAL_GC
+	for (int i=0; i < vm.nursery.rememberedCount; i++){
+		vm.nursery.remembered[i] = forward(vm.nursery.remembered[i]);
+	}
+	#endif
+
+	extern Compiler* currentCompiler;
+	for (Compiler* compiler = currentCompiler; compiler != NULL; compiler = compiler->parentCompiler){
+		compiler->function = (ObjectFunction*) forward((Object*) compiler->function);
+	}
+}
+
+// Updates every reference of the object to the objects that moved
+static void forwardObject(Object* object){
+
+	switch(object->objectType){
+		case OBJECT_NATIVE_FUNCTION:
+			{
+				ObjectNativeFunction* objNative = (ObjectNativeFunction*) object;
+				objNative->name = (ObjectString*) forward((Object*) objNative->name);
+			}
+			break;
+		case OBJECT_FUNCTION:
+			{
+				ObjectFunction* objFunc = (ObjectFunction*) object;
+				objFunc->name = (ObjectString*) forward((Object*) objFunc->name);
+
+				ValueArray* constants = &(objFunc->chunk->constants);
+				for (int i=0; i < constants->count; i++){
+					forwardValue(constants->values + i);
+				}
+
+				// The shapes of the caches follow their class, see relocateObject()
+				for (int i=0; i < objFunc->chunk->cacheCount; i++){
+					InlineCache* cache = objFunc->chunk->caches + i;
+					cache->Class = (ObjectClass*) forward((Object*) cache->Class);
+					cache->method = (ObjectClosure*) forward((Object*) cache->method);
+				}
+			}
+			break;
+		case OBJECT_CLOSURE:
+			{
+				ObjectClosure* objClosure = (ObjectClosure*) object;
+				objClosure->function = (ObjectFunction*) forward((Object*) objClosure->function);
+				for (int i=0; i < objClosure->upvaluesCount; i++){
+					objClosure->objUpvalues[i] = (ObjectUpvalue*) forward((Object*) objClosure->objUpvalues[i]);
+				}
+			}
+			break;
+		case OBJECT_UPVALUE:
+			{
+				// Open upvalues point into the stack, which is forwarded with the roots
+				ObjectUpvalue* objUpvalue = (ObjectUpvalue*) object;
+				if (objUpvalue->value == &objUpvalue->closedValue) forwardValue(&objUpvalue->closedValue);
+			}
+			break;
+		case OBJECT_CLASS:
+			{
+				ObjectClass* objClass = (ObjectClass*) object;
+				objClass->name = (ObjectString*) forward((Object*) objClass->name);
+				objClass->superclass = (ObjectClass*) forward((Object*) objClass->superclass);
+				objClass->initializer = (ObjectClosure*) forward((Object*) objClass->initializer);
+				for (int i=0; i < objClass->vtableSize; i++){
+					objClass->vtable[i] = (ObjectClosure*) forward((Object*) objClass->vtable[i]);
+				}
+				forwardShapeTree(objClass->rootShape);
+			}
+			break;
+		case OBJECT_INSTANCE:
+			{
+				ObjectInstance* objInstance = (ObjectInstance*) object;
+				objInstance->Class = (ObjectClass*) forward((Object*) objInstance->Class);
+				if (IS_DICTIONARY_MODE(objInstance)){
+					forwardTable(objInstance->dictionary);
+				} else{
+					for (int i=0; i < objInstance->shape->fieldCount; i++){
+						forwardValue(objInstance->fields + i);
+					}
+				}
+			}
+			break;
+		case OBJECT_BOUND_METHOD:
+			{
+				ObjectBoundMethod* boundMethod = (ObjectBoundMethod*) object;
+				boundMethod->closure = (ObjectClosure*) forward((Object*) boundMethod->closure);
+				boundMethod->instance = (ObjectInstance*) forward((Object*) boundMethod->instance);
+			}
+			break;
+		case OBJECT_ROPE:
+			{
+				ObjectRope* rope = (ObjectRope*) object;
+				rope->left = forward(rope->left);
+				rope->right = forward(rope->right);
+				rope->flat = (ObjectString*) forward((Object*) rope->flat);
+			}
+			break;
+		case OBJECT_STRING:
+			// Nothing to do
+			break;
+	}
+}
+
+// Called once the objects of the evacuated pages were moved: walks the roots and every page of the old generation
+void updateReferences(){
+	forwardRoots();
+
+	for (int i=0; i < SLAB_SIZE_CLASSES; i++){
+		for (SlabPage* page = vm.slab.classes[i].pages; page != NULL; page = page->next){
+			for (int slot=0; slot < page->capacity; slot++){
+				if (IS_SLOT_ALLOCATED(page, slot)) forwardObject(SLOT_OBJECT(page, slot));
+			}
+		}
+	}
+	for (LargeObject* header = vm.slab.largeObjects; header != NULL; header = header->next){
+		forwardObject(LARGE_OBJECT(header));
+	}
+}
+
+// Called when a gc cycle is over: requests a compaction at the next safepoint if the mode asks for one
+void considerCompaction(){
+	switch (vm.gc.compactMode){
+		case COMPACT_NEVER:
+			return;
+		case COMPACT_WHEN_FRAGMENTED:
+			{
+				int pages = 0;
+				for (int i=0; i < SLAB_SIZE_CLASSES; i++){
+					pages += vm.slab.classes[i].pageCount;
+				}
+				int reclaimable = reclaimableSlabPages();
+				if (reclaimable < GC_COMPACT_MIN_PAGES || reclaimable * 100 < pages * GC_COMPACT_THRESHOLD) return;
+			}
+			break;
+		case COMPACT_ALWAYS:
+			break;
+	}
+
+	vm.gc.isCompactionPending = true;
+	#ifdef GENERATIONAL_GC
+	// The nursery has to be empty: the safepoint runs a minor gc first
+	vm.nursery.isFull = true;
+	#endif
+}
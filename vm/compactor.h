@@ -0,0 +1,15 @@
+#ifndef COMPACTOR_H
+#define COMPACTOR_H
+
+#include "../common.h"
+#include "object.h"
+
+// Compaction: once a gc cycle is over, the objects of the sparsest slab pages are moved to the densest ones and the emptied pages released
+// Objects move, so like a minor gc this only runs at a safepoint of the vm loop, where every reference is reachable from the roots
+// Large objects and young objects never move (the nursery is emptied first)
+
+// function prototypes
+void considerCompaction();
+void updateReferences();
+
+#endif
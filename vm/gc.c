@@ -1,7 +1,10 @@
 #include <stdio.h>
+#include <limits.h>
 
 #include "gc.h"
 #include "vm.h"
+#include "shape.h"
+#include "marker.h"
 #include "../compiler/compiler.h"
 
 extern VM vm;
@@ -10,15 +13,53 @@ void initGC(){
 	vm.gc.count = 0;
 	vm.gc.capacity = 0;
 	vm.gc.objectsQueue = NULL;
+
+	vm.gc.state = GC_IDLE;
+	vm.gc.sliceBudget = GC_SLICE_BUDGET;
+	vm.gc.markThreads = GC_MARK_THREADS;
+	vm.gc.initialTrigger = INITIAL_GC_TRIGGER_VALUE;
+	vm.gc.growthFactor = GC_GROWTH_FACTOR;
+	vm.gc.minHeap = GC_MIN_HEAP;
+	vm.gc.heapLimit = GC_MAX_HEAP;
+	vm.gc.compactMode = GC_COMPACT_MODE;
+	vm.gc.isCompactionPending = false;
+	vm.gc.nextSlice = 0;
+	vm.gc.isSliceOverdue = false;
+	vm.gc.isDeferred = false;
+
+	vm.gc.openUpvaluesCount = 0;
+	vm.gc.openUpvaluesCapacity = 0;
+	vm.gc.openUpvalues = NULL;
+
+	initGCStats();
 }
 
+// Frees the queues once a gc cycle is over, the settings and statistics are kept
 void resetGC(){
 	free(vm.gc.objectsQueue);	
-	initGC();
+	vm.gc.count = 0;
+	vm.gc.capacity = 0;
+	vm.gc.objectsQueue = NULL;
+
+	free(vm.gc.openUpvalues);
+	vm.gc.openUpvaluesCount = 0;
+	vm.gc.openUpvaluesCapacity = 0;
+	vm.gc.openUpvalues = NULL;
+}
+
+void addValue(Value value){
+	if (IS_OBJ(value)) addObject(AS_OBJ(value));
 }
 
+// Objects that are already marked are not queued again, such as the class of every instance
 void addObject(Object* object){
-	if (object == NULL) return;
+	if (object == NULL || isObjectMarked(object)) return;
+	#ifdef PARALLEL_MARKING
+	if (currentMarkWorker != NULL){
+		pushMarkWork(currentMarkWorker, object);
+		return;
+	}
+	#endif
 	if (vm.gc.count == vm.gc.capacity){
 		vm.gc.capacity = GROW_CAPACITY(vm.gc.capacity);
 		vm.gc.objectsQueue = (Object**) realloc(vm.gc.objectsQueue, sizeof(Object*) *  vm.gc.capacity);
@@ -28,33 +69,67 @@ void addObject(Object* object){
 	vm.gc.objectsQueue[vm.gc.count++] = object;
 }
 
+// WRITE_BARRIER as a function call, for the vm loop: inlined there it takes registers away from the hot instructions
+void writeBarrier(Object* owner, Value value){
+	WRITE_BARRIER(owner, value);
+}
+
 void markObjects(){
 
-	// The idea is that we do a breadth first search
+	// The idea is that we do a depth first search
 	// First, we mark the roots and add their child objects to the queue
 	markRoots();
 	markCompilerRoots();
-	// Then we remove an Object from the idea, mark it, add their child objects to the queue and keep repeating until there are no more objects in the queue
-	int index=0;
-	while (index < vm.gc.count){
-		Object* obj = vm.gc.objectsQueue[index];	
+	markOpenUpvalues();
+	// Then we take the last object from the queue, mark it, add their child objects to the queue and keep repeating until there are no more objects in the queue
+	#ifdef PARALLEL_MARKING
+	if (vm.gc.markThreads > 1){
+		markQueuedObjectsInParallel(vm.gc.markThreads);
+		return;
+	}
+	#endif
+	markQueuedObjects(INT_MAX);
+}
+
+// Marks objects from the queue until `budget` bytes of them were marked, returns whether the queue is empty
+// Counting bytes rather than objects keeps the slices in step with the allocations, whatever the size of the objects
+bool markQueuedObjects(int budget){
+	while (vm.gc.count > 0 && budget > 0){
+		Object* obj = vm.gc.objectsQueue[--vm.gc.count];
 		markObject(obj);
-		index++;
+		budget -= objectSize(obj);
 	}
+	return vm.gc.count == 0;
 }
 
 void markRoots(){
 	// mark "init" string from vm
 	markObject((Object*) vm.init);
 
+	// method names keep their selectors for as long as the vm runs
+	for (int i=0; i < vm.selectorNames.count; i++){
+		markValue(vm.selectorNames.values[i]);
+	}
+
 	// mark the global variables first
-	markHashTable(&vm.globals);
+	markHashTable(&vm.globalSlots);
+	for (int i=0; i < vm.globalValues.count; i++){
+		markValue(vm.globalValues.values[i]);
+	}
+	for (int i=0; i < vm.globalNames.count; i++){
+		markValue(vm.globalNames.values[i]);
+	}
 
 	// mark the stack values
 	markStack();
 
 	//call frame mark
 	markCallFrame();
+
+	// open upvalues are closed when their stack slot is popped, even if no closure refers to them anymore
+	for (int i=0; i < STACK_MAX_SIZE; i++){
+		markObject((Object*) vm.openObjUpvalues[i]);
+	}
 }
 
 void markCompilerRoots(){
@@ -68,14 +143,84 @@ void markCompilerRoots(){
 }
 
 
+// Marks the current value of the upvalues that were open when they got marked during an incremental cycle
+void markOpenUpvalues(){
+	for (int i=0; i < vm.gc.openUpvaluesCount; i++){
+		markValue(*vm.gc.openUpvalues[i]->value);
+	}
+}
+
+static void addOpenUpvalue(ObjectUpvalue* upvalue){
+	if (vm.gc.openUpvaluesCount == vm.gc.openUpvaluesCapacity){
+		vm.gc.openUpvaluesCapacity = GROW_CAPACITY(vm.gc.openUpvaluesCapacity);
+		vm.gc.openUpvalues = (ObjectUpvalue**) realloc(vm.gc.openUpvalues, sizeof(ObjectUpvalue*) * vm.gc.openUpvaluesCapacity);
+		if (vm.gc.openUpvalues == NULL) exit(1);
+	}
+
+	vm.gc.openUpvalues[vm.gc.openUpvaluesCount++] = upvalue;
+}
+
 void markValue(Value value){
 	if (IS_OBJ(value)) markObject(AS_OBJ(value));
 }
 
+// Marking only writes to side bitmaps, never to the objects: the nursery's for young objects, the page's for the ones in the slab
+// and the header in front of large objects. Returns the word holding the mark of the object, and its bit in `bit`
+static inline uint64_t* findMark(Object* object, uint64_t* bit){
+	#ifdef GENERATIONAL_GC
+	if (IS_YOUNG(object)){
+		size_t index = ((uint8_t*) object - vm.nursery.start) / 8;
+		*bit = (uint64_t) 1 << (index % 64);
+		return vm.nursery.marks + index / 64;
+	}
+	#endif
+
+	if (object->isLarge){
+		*bit = 1;
+		return &LARGE_OBJECT_HEADER(object)->marks;
+	}
+
+	SlabPage* page = SLAB_PAGE_OF(object);
+	size_t index = MARK_INDEX(page, object);
+	*bit = (uint64_t) 1 << (index % 64);
+	return page->marks + index / 64;
+}
+
+bool isObjectMarked(Object* object){
+	uint64_t bit;
+	uint64_t* marks = findMark(object, &bit);
+	#ifdef PARALLEL_MARKING
+	// Other marking threads may be setting bits of the same word
+	return (__atomic_load_n(marks, __ATOMIC_RELAXED) & bit) != 0;
+	#else
+	return (*marks & bit) != 0;
+	#endif
+}
+
+// Sets the mark of the object, returns false if it was already set
+static inline bool setMark(Object* object){
+	uint64_t bit;
+	uint64_t* marks = findMark(object, &bit);
+
+	#ifdef PARALLEL_MARKING
+	// Marking threads race for the objects, only the one that sets the mark scans them
+	if (currentMarkWorker != NULL) return !(__atomic_load_n(marks, __ATOMIC_RELAXED) & bit) && !(__atomic_fetch_or(marks, bit, __ATOMIC_RELAXED) & bit);
+	#endif
+
+	if (*marks & bit) return false;
+	*marks |= bit;
+	return true;
+}
+
+// Marks an object without scanning it, for the copy of a young object that was already marked
+void setObjectMark(Object* object){
+	setMark(object);
+}
+
 void markObject(Object* object){
 
 	if (object == NULL) return;
-	if (object->isMarked) return;
+	if (!setMark(object)) return;
 
 	#ifdef DEBUG_LOG_GC
 	printf("mark type: %d\t", object->objectType);
@@ -83,16 +228,14 @@ void markObject(Object* object){
 	printf("\n");
 	#endif
 
-	object->isMarked = true;
-
 	addChildObjectsToGCQueue(object);
 }
 
 void markHashTable(Table* table){
 	for (int i=0; i < table->capacity; i++){
-		if ((table->entries[i].key != NULL) || (table->entries[i].value.type != TYPE_NIL)){
-			markObject((Object *) table->entries[i].key);
-			markValue(table->entries[i].value);
+		if (TABLE_KEY(table, i) != NULL){
+			markObject((Object *) TABLE_KEY(table, i));
+			markValue(TABLE_VALUE(table, i));
 		}
 	}
 }
@@ -112,9 +255,16 @@ void markCallFrame(){
 
 void addTableToGCQueue(Table* table){
 	for (int i=0; i< table->capacity; i++){
-		Entry entry = table->entries[i];
-		addObject((Object*) entry.key);
-		addObject(AS_OBJ(entry.value));
+		if (TABLE_KEY(table, i) == NULL) continue;
+		addObject((Object*) TABLE_KEY(table, i));
+		addValue(TABLE_VALUE(table, i));
+	}
+}
+
+void addShapeTreeToGCQueue(Shape* shape){
+	addObject((Object*) shape->key);
+	for (Shape* child = shape->firstChild; child != NULL; child = child->nextSibling){
+		addShapeTreeToGCQueue(child);
 	}
 }
 
@@ -137,6 +287,14 @@ void addChildObjectsToGCQueue(Object* object){
 					Value value = objFuncConstArray->values[i];
 					markValue(value);
 				}
+
+				// Inline caches hold strong references so that a cached class (or the class owning a cached shape) can never be freed and its address reused
+				for (int i=0; i < objFunc->chunk->cacheCount; i++){
+					InlineCache* cache = objFunc->chunk->caches + i;
+					addObject((Object*) cache->Class);
+					addObject((Object*) cache->method);
+					if (cache->shape != NULL) addObject((Object*) cache->shape->Class);
+				}
 			}
 			break;
 		case OBJECT_CLOSURE:
@@ -151,8 +309,8 @@ void addChildObjectsToGCQueue(Object* object){
 		case OBJECT_UPVALUE:
 			{
 				ObjectUpvalue* objUpvalue = (ObjectUpvalue*) object;
-				Value value = *objUpvalue->value;
-				addObject(AS_OBJ(value));
+				addValue(*objUpvalue->value);
+				if (vm.gc.state == GC_MARKING && objUpvalue->value != &objUpvalue->closedValue) addOpenUpvalue(objUpvalue);
 			}
 			break;
 		case OBJECT_CLASS:
@@ -160,14 +318,23 @@ void addChildObjectsToGCQueue(Object* object){
 				ObjectClass* objClass = (ObjectClass*) object;
 				addObject((Object*) objClass->name);
 				addObject((Object*) objClass->superclass);
-				addTableToGCQueue(objClass->methods);	
+				for (int i=0; i < objClass->vtableSize; i++){
+					addObject((Object*) objClass->vtable[i]);
+				}
+				addShapeTreeToGCQueue(objClass->rootShape);
 			}
 			break;
 		case OBJECT_INSTANCE:
 			{
 				ObjectInstance* objInstance = (ObjectInstance*) object;
 				addObject((Object*) objInstance->Class);
-				addTableToGCQueue(objInstance->fields);	
+				if (IS_DICTIONARY_MODE(objInstance)){
+					addTableToGCQueue(objInstance->dictionary);
+				} else{
+					for (int i=0; i < objInstance->shape->fieldCount; i++){
+						addValue(objInstance->fields[i]);
+					}
+				}
 			}
 			break;
 		case OBJECT_BOUND_METHOD:
@@ -177,6 +344,14 @@ void addChildObjectsToGCQueue(Object* object){
 				addObject((Object*)boundMethod->instance);
 			}
 			break;
+		case OBJECT_ROPE:
+			{
+				ObjectRope* rope = (ObjectRope*) object;
+				addObject(rope->left);
+				addObject(rope->right);
+				addObject((Object*) rope->flat);
+			}
+			break;
 		case OBJECT_STRING:
 			// Nothing to do
 			break;
@@ -187,34 +362,14 @@ void addChildObjectsToGCQueue(Object* object){
 void freeStringsFromVMHashTable(){
 	
 	for (int i=0; i< vm.strings.capacity; i++){
-		Entry entry = vm.strings.entries[i];
-		if (entry.key != NULL && !(((Object*) entry.key)->isMarked))
-			tableDelete(&vm.strings, entry.key);
+		ObjectString* key = TABLE_KEY(&vm.strings, i);
+		// Deleting can move a later entry back into this slot, which then has to be looked at again
+		if (key != NULL && !isObjectMarked((Object*) key) && tableDelete(&vm.strings, key)) i--;
 	}
 }
 
-void sweepObjects(){
-
-	Object* previous = NULL;
-	Object* current = vm.objects;
-	while (current != NULL){
-
-		if (current->isMarked){
-			current->isMarked = false;
-			previous = current;	
-			current = current->next;
-		} else {
-			if (previous == NULL) {
-				vm.objects = current->next;
-				freeObject(current);
-				current = vm.objects;
-
-			} else{
-				current = current->next;
-				freeObject(previous->next);
-			        previous->next = current;
-			}
-		}
-	}
+// Sweeps the slab pages, then the large objects
+// Stops after `budget` objects (or slots), returns whether every object was swept
+bool sweepObjects(int budget){
+	return sweepSlabPages(&budget) && sweepLargeObjects(&budget);
 }
-
@@ -3,6 +3,7 @@
 
 #include "object.h"
 #include "memory.h"
+#include "gcstats.h"
 
 #include <stdlib.h>
 
@@ -10,21 +11,104 @@
 void initGC();
 void resetGC();
 
+typedef enum{
+	GC_IDLE,
+	// An incremental cycle is in progress: the mutator runs between the marking slices
+	GC_MARKING,
+	// Marking is over, the dead objects are freed by the slices
+	GC_SWEEPING,
+} GCState;
+
+typedef enum{
+	COMPACT_NEVER,
+	// After the gc cycles that leave the slab pages sparse enough
+	COMPACT_WHEN_FRAGMENTED,
+	// After every gc cycle
+	COMPACT_ALWAYS,
+} CompactMode;
+
+// Tri-color marking: marked objects are black, queued objects that are not marked yet are gray, and the rest is white
 typedef struct{
 	int capacity;
 	int count;
+	// Used as a stack: marking goes depth first, which keeps the queue as short as the object graph is deep instead of as wide,
+	// and marks the children of an object right after it
 	Object** objectsQueue;
+
+	GCState state;
+	// Bytes of queued objects an incremental slice marks
+	int sliceBudget;
+	// Value of bytesAllocated at which the next slice runs
+	int64_t nextSlice;
+	// Set when a slice left work to the next ones: they then also run on young allocations, which do not count towards bytesAllocated
+	bool isSliceOverdue;
+
+	// Threads marking the heap when the world is stopped, more than one replaces the incremental slices with parallel marking
+	int markThreads;
+
+	// Heap sizing, set with the --gc-* options or the CLOX_GC_* environment variables (see common.h)
+	int64_t initialTrigger;
+	double growthFactor;
+	int64_t minHeap;
+	// 0 when the heap has no limit
+	int64_t heapLimit;
+
+	// Set while a rope is flattened: no gc starts or steps, since the rope may only be referenced from C locals (see flattenRope)
+	bool isDeferred;
+
+	CompactMode compactMode;
+	// Set when the heap is to be compacted at the next safepoint
+	bool isCompactionPending;
+
+	// Upvalues that were open when they got marked during the current cycle
+	// Closing an upvalue has no write barrier, so their value is marked again when the cycle finishes
+	int openUpvaluesCount;
+	int openUpvaluesCapacity;
+	ObjectUpvalue** openUpvalues;
+
+	GCStats stats;
 } GC;
 
+#ifdef INCREMENTAL_GC
+
+// Insertion barrier keeping the tri-color invariant while marking: a black object never points to a white one
+#define MARKING_BARRIER(owner, object) \
+		do { \
+			if (vm.gc.state == GC_MARKING && isObjectMarked((Object*) (owner))) markObject(object); \
+		} while (false)
+
+#else
+
+#define MARKING_BARRIER(owner, object) do {} while (false)
+
+#endif
+
+// Has to follow every store of `value` into a field of the object `owner`
+// Roots (the stack, globals, ...) are scanned again by every gc and need no barrier
+#define WRITE_BARRIER(owner, value) \
+		do { \
+			Value stored = (value); \
+			if (IS_OBJ(stored)){ \
+				REMEMBER_BARRIER(owner, AS_OBJ(stored)); \
+				MARKING_BARRIER(owner, AS_OBJ(stored)); \
+			} \
+		} while (false)
+
 
 void addObject(Object*);
+void addValue(Value);
+void writeBarrier(Object*, Value);
 
 void markObjects();
+bool markQueuedObjects(int budget);
 void markRoots();
 void markCompilerRoots();
+void markOpenUpvalues();
 
-void sweepObjects();
+bool sweepObjects(int budget);
 
+bool isObjectMarked(Object*);
+void setObjectMark(Object*);
 void markValue(Value value);
 void markObject(Object* object);
 void markHashTable(Table* table);
@@ -32,5 +116,6 @@ void markStack();
 void markCallFrame();
 
 void addChildObjectsToGCQueue(Object*);
+void addShapeTreeToGCQueue(struct Shape*);
 void freeStringsFromVMHashTable();
 #endif
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "gcstats.h"
+#include "vm.h"
+
+extern VM vm;
+
+// Upper bounds of the pause histogram buckets, in ms
+static const double pauseBuckets[GC_PAUSE_BUCKETS - 1] = {0.1, 0.25, 0.5, 1, 2, 5, 10, 20, 50, 100};
+static const char* pauseBucketNames[GC_PAUSE_BUCKETS] = {
+	"pauses<0.1ms", "pauses<0.25ms", "pauses<0.5ms", "pauses<1ms", "pauses<2ms", "pauses<5ms",
+	"pauses<10ms", "pauses<20ms", "pauses<50ms", "pauses<100ms", "pauses>=100ms",
+};
+static const char* freedObjectNames[OBJECT_TYPE_COUNT] = {
+	"freedStrings", "freedFunctions", "freedNativeFunctions", "freedClosures",
+	"freedUpvalues", "freedClasses", "freedInstances", "freedBoundMethods", "freedRopes",
+};
+
+void initGCStats(){
+	memset(&vm.gc.stats, 0, sizeof(vm.gc.stats));
+}
+
+// Wall clock time in ms: the cpu time clock() measures adds up the time of every marking thread
+double currentTime(){
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
+
+void startCycleStats(){
+	vm.gc.stats.cycles++;
+	vm.gc.stats.current = (GCCycleStats) {.cycle = vm.gc.stats.cycles, .markTime = 0, .sweepTime = 0, .bytesFreed = 0, .heapBefore = vm.bytesAllocated, .heapAfter = 0};
+}
+
+// Called once the cycle swept the whole heap
+void finishCycleStats(){
+	GCStats* stats = &vm.gc.stats;
+	stats->current.heapAfter = vm.bytesAllocated;
+	stats->history[stats->finishedCycles % GC_CYCLE_HISTORY] = stats->current;
+	stats->finishedCycles++;
+
+	stats->markTime += stats->current.markTime;
+	stats->sweepTime += stats->current.sweepTime;
+	stats->bytesFreed += stats->current.bytesFreed;
+}
+
+void recordPause(double start){
+	double pause = currentTime() - start;
+	GCStats* stats = &vm.gc.stats;
+
+	stats->pauses++;
+	stats->totalPause += pause;
+	if (pause > stats->maxPause) stats->maxPause = pause;
+
+	int bucket = 0;
+	while (bucket < GC_PAUSE_BUCKETS - 1 && pause >= pauseBuckets[bucket]) bucket++;
+	stats->pauseHistogram[bucket]++;
+
+	#ifdef DEBUG_LOG_GC
+	printf("- Pause: %.3f ms -\n", pause);
+	#endif
+}
+
+typedef enum{
+	STAT_COUNT,
+	STAT_BYTES,
+	STAT_MS,
+} StatUnit;
+
+typedef struct{
+	const char* name;
+	StatUnit unit;
+	double value;
+} GCStat;
+
+#define STATS_MAX (32 + OBJECT_TYPE_COUNT + GC_PAUSE_BUCKETS)
+
+// The last finished cycle, all zeros before the first one
+static GCCycleStats lastCycle(){
+	GCStats* stats = &vm.gc.stats;
+	if (stats->finishedCycles == 0) return (GCCycleStats) {0};
+	return stats->history[(stats->finishedCycles - 1) % GC_CYCLE_HISTORY];
+}
+
+// Fills `list` with every statistic, in the order they are reported, and returns how many there are
+static int listGCStats(GCStat* list){
+	GCStats* stats = &vm.gc.stats;
+	int count = 0;
+
+	#define STAT(name, unit, value) list[count++] = (GCStat) {name, unit, (double) (value)}
+
+	STAT("cycles", STAT_COUNT, stats->cycles);
+	STAT("slices", STAT_COUNT, stats->slices);
+	STAT("minorCollections", STAT_COUNT, stats->minorCollections);
+	STAT("compactions", STAT_COUNT, stats->compactions);
+	STAT("releasedPages", STAT_COUNT, stats->releasedPages);
+	STAT("emergencyCollections", STAT_COUNT, stats->emergencyCollections);
+
+	STAT("markTime", STAT_MS, stats->markTime);
+	STAT("sweepTime", STAT_MS, stats->sweepTime);
+	STAT("minorTime", STAT_MS, stats->minorTime);
+	STAT("compactTime", STAT_MS, stats->compactTime);
+
+	STAT("bytesAllocated", STAT_BYTES, vm.bytesAllocated);
+	STAT("nextGCRun", STAT_BYTES, vm.nextGCRun);
+	// A program often exits in the middle of a lazy sweep, which may already have freed most of the bytes
+	STAT("bytesFreed", STAT_BYTES, stats->bytesFreed + (vm.gc.state == GC_SWEEPING ? stats->current.bytesFreed : 0));
+	STAT("bytesPromoted", STAT_BYTES, stats->bytesPromoted);
+	STAT("youngBytesFreed", STAT_BYTES, stats->youngBytesFreed);
+
+	GCCycleStats last = lastCycle();
+	STAT("lastMarkTime", STAT_MS, last.markTime);
+	STAT("lastSweepTime", STAT_MS, last.sweepTime);
+	STAT("lastBytesFreed", STAT_BYTES, last.bytesFreed);
+	STAT("lastHeapBefore", STAT_BYTES, last.heapBefore);
+	STAT("lastHeapAfter", STAT_BYTES, last.heapAfter);
+
+	for (int type=0; type < OBJECT_TYPE_COUNT; type++){
+		STAT(freedObjectNames[type], STAT_COUNT, stats->freedObjects[type]);
+	}
+
+	STAT("pauses", STAT_COUNT, stats->pauses);
+	STAT("totalPause", STAT_MS, stats->totalPause);
+	STAT("maxPause", STAT_MS, stats->maxPause);
+	for (int bucket=0; bucket < GC_PAUSE_BUCKETS; bucket++){
+		STAT(pauseBucketNames[bucket], STAT_COUNT, stats->pauseHistogram[bucket]);
+	}
+
+	#undef STAT
+	return count;
+}
+
+// Returns false if there is no statistic called `name`
+bool getGCStat(const char* name, double* value){
+	GCStat list[STATS_MAX];
+	int count = listGCStats(list);
+
+	for (int i=0; i < count; i++){
+		if (strcmp(list[i].name, name) == 0){
+			*value = list[i].value;
+			return true;
+		}
+	}
+	return false;
+}
+
+// One `gc.name value` line per statistic, then one `gc.cycle` line per finished cycle still kept (and how many older ones were dropped),
+// on stderr so that it does not get mixed with the output of the program
+void printGCStats(){
+	GCStat list[STATS_MAX];
+	int count = listGCStats(list);
+
+	for (int i=0; i < count; i++){
+		switch (list[i].unit){
+			case STAT_COUNT: fprintf(stderr, "gc.%-22s %.0f\n", list[i].name, list[i].value); break;
+			case STAT_BYTES: fprintf(stderr, "gc.%-22s %.0f bytes\n", list[i].name, list[i].value); break;
+			case STAT_MS: fprintf(stderr, "gc.%-22s %.3f ms\n", list[i].name, list[i].value); break;
+		}
+	}
+
+	GCStats* stats = &vm.gc.stats;
+	int first = stats->finishedCycles > GC_CYCLE_HISTORY ? stats->finishedCycles - GC_CYCLE_HISTORY : 0;
+	if (first > 0) fprintf(stderr, "gc.%-22s %d\n", "droppedCycles", first);
+	for (int i=first; i < stats->finishedCycles; i++){
+		GCCycleStats* cycle = stats->history + i % GC_CYCLE_HISTORY;
+		fprintf(stderr, "gc.cycle %-16d mark %.3f ms, sweep %.3f ms, freed %lld bytes, heap %lld -> %lld bytes\n", cycle->cycle, cycle->markTime,
+				cycle->sweepTime, (long long) cycle->bytesFreed, (long long) cycle->heapBefore, (long long) cycle->heapAfter);
+	}
+}
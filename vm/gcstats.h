@@ -0,0 +1,73 @@
+#ifndef GC_STATS_H
+#define GC_STATS_H
+
+#include "../common.h"
+#include "object.h"
+
+// Pause time buckets, the last one holds every pause longer than the others
+#define GC_PAUSE_BUCKETS 11
+// Finished cycles whose stats are kept for the report, older ones are overwritten
+#define GC_CYCLE_HISTORY 256
+
+// What a single gc cycle did, from its first marking slice to its last sweeping one
+typedef struct{
+	// Numbered from 1, in the order the cycles started
+	int cycle;
+	// Time spent marking and sweeping, in ms: the sum of the slices of an incremental cycle
+	// Pages an allocation swept on demand are not timed, see slabAllocate
+	double markTime;
+	double sweepTime;
+	// Bytes the sweep freed: the dead objects and what they owned outside of themselves
+	int64_t bytesFreed;
+	// Heap size (bytes allocated) when the cycle started, and when it was done sweeping
+	// The mutator keeps allocating during an incremental cycle, so the heap can grow even though the sweep freed a lot
+	int64_t heapBefore;
+	int64_t heapAfter;
+} GCCycleStats;
+
+// Always kept up to date, printed at exit with --gc-stats and read by the gcStats() native
+typedef struct{
+	int cycles;
+	int slices;
+	int minorCollections;
+	int compactions;
+	int releasedPages;
+	// Incremental cycles that fell so far behind the allocations that they were finished by stopping the world
+	int emergencyCollections;
+
+	// Totals of the finished cycles
+	double markTime;
+	double sweepTime;
+	int64_t bytesFreed;
+	// Minor gcs and compactions, in ms
+	double minorTime;
+	double compactTime;
+	int64_t bytesPromoted;
+	// Dead young objects, and what they owned outside of the nursery
+	int64_t youngBytesFreed;
+
+	uint64_t freedObjects[OBJECT_TYPE_COUNT];
+
+	// Every time the mutator was stopped: a cycle start, a slice, a stop the world collection, a minor gc or a compaction
+	int pauses;
+	double totalPause;
+	double maxPause;
+	int pauseHistogram[GC_PAUSE_BUCKETS];
+
+	// The cycle in progress, and the last GC_CYCLE_HISTORY finished ones: finished cycle i is at i % GC_CYCLE_HISTORY
+	GCCycleStats current;
+	int finishedCycles;
+	GCCycleStats history[GC_CYCLE_HISTORY];
+} GCStats;
+
+void initGCStats();
+double currentTime();
+
+void startCycleStats();
+void finishCycleStats();
+void recordPause(double start);
+
+bool getGCStat(const char* name, double* value);
+void printGCStats();
+
+#endif
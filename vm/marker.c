@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "marker.h"
+#include "vm.h"
+
+extern VM vm;
+
+#ifdef PARALLEL_MARKING
+
+#define INITIAL_DEQUE_SIZE 1024
+
+__thread MarkWorker* currentMarkWorker = NULL;
+
+static MarkWorker* workers;
+static int workerCount;
+// Threads taking part in the marking, and how many of them ran out of work
+static int participants;
+static int idleWorkers;
+
+static MarkArray* makeMarkArray(int64_t size, MarkArray* previous){
+	MarkArray* array = (MarkArray*) malloc(sizeof(MarkArray) + sizeof(Object*) * size);
+	if (array == NULL) exit(1);
+	array->size = size;
+	array->previous = previous;
+	return array;
+}
+
+static void initMarkDeque(MarkDeque* deque){
+	deque->top = 0;
+	deque->bottom = 0;
+	deque->array = makeMarkArray(INITIAL_DEQUE_SIZE, NULL);
+}
+
+static void freeMarkDeque(MarkDeque* deque){
+	MarkArray* array = deque->array;
+	while (array != NULL){
+		MarkArray* previous = array->previous;
+		free(array);
+		array = previous;
+	}
+}
+
+// Only called by the owner of the deque
+void pushMarkWork(MarkWorker* worker, Object* object){
+	MarkDeque* deque = &worker->deque;
+	int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	MarkArray* array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+	if (bottom - top > array->size - 1){
+		MarkArray* bigger = makeMarkArray(array->size * 2, array);
+		for (int64_t i = top; i < bottom; i++){
+			bigger->objects[i & (bigger->size - 1)] = __atomic_load_n(&array->objects[i & (array->size - 1)], __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&deque->array, bigger, __ATOMIC_RELEASE);
+		array = bigger;
+	}
+
+	__atomic_store_n(&array->objects[bottom & (array->size - 1)], object, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+// Only called by the owner of the deque, returns NULL if it is empty
+static Object* takeMarkWork(MarkWorker* worker){
+	MarkDeque* deque = &worker->deque;
+	int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	MarkArray* array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+	__atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+	if (top > bottom){
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	Object* object = __atomic_load_n(&array->objects[bottom & (array->size - 1)], __ATOMIC_RELAXED);
+	if (top == bottom){
+		// Last object: race the thieves for it
+		if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) object = NULL;
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+	}
+	return object;
+}
+
+// Returns NULL if the deque is empty, or if another thread took the object first
+static Object* stealMarkWork(MarkDeque* deque){
+	int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	if (top >= bottom) return NULL;
+
+	MarkArray* array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+	Object* object = __atomic_load_n(&array->objects[top & (array->size - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return NULL;
+	return object;
+}
+
+static bool isMarkDequeEmpty(MarkDeque* deque){
+	return __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE) >= __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+}
+
+// Tries every other deque once, starting from a random one
+static Object* stealFromOtherWorkers(MarkWorker* worker){
+	int start = rand_r(&worker->seed) % workerCount;
+	for (int i=0; i < workerCount; i++){
+		MarkWorker* victim = workers + (start + i) % workerCount;
+		if (victim == worker) continue;
+
+		Object* object = stealMarkWork(&victim->deque);
+		if (object != NULL) return object;
+	}
+	return NULL;
+}
+
+// Returns false once every thread is out of work, which means marking is over: only threads with work push more of it
+static bool waitForMarkWork(){
+	__atomic_add_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+	while (true){
+		for (int i=0; i < workerCount; i++){
+			if (!isMarkDequeEmpty(&workers[i].deque)){
+				__atomic_sub_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+				return true;
+			}
+		}
+		if (__atomic_load_n(&idleWorkers, __ATOMIC_SEQ_CST) == __atomic_load_n(&participants, __ATOMIC_SEQ_CST)) return false;
+		sched_yield();
+	}
+}
+
+static void* runMarkWorker(void* argument){
+	MarkWorker* worker = (MarkWorker*) argument;
+	currentMarkWorker = worker;
+
+	while (true){
+		Object* object = takeMarkWork(worker);
+		if (object == NULL) object = stealFromOtherWorkers(worker);
+		if (object == NULL){
+			if (waitForMarkWork()) continue;
+			break;
+		}
+		// Pushes the children of the object to the deque of this thread
+		markObject(object);
+	}
+
+	currentMarkWorker = NULL;
+	return NULL;
+}
+
+// Marks everything reachable from the gc queue with `threads` threads (the vm thread being one of them)
+// The queued objects are dealt out to the deques of the threads, which then steal from each other once their own deque is empty
+void markQueuedObjectsInParallel(int threads){
+	workers = (MarkWorker*) malloc(sizeof(MarkWorker) * threads);
+	pthread_t* handles = (pthread_t*) malloc(sizeof(pthread_t) * threads);
+	if (workers == NULL || handles == NULL) exit(1);
+	workerCount = threads;
+
+	for (int i=0; i < threads; i++){
+		initMarkDeque(&workers[i].deque);
+		workers[i].seed = i + 1;
+	}
+	for (int i=0; i < vm.gc.count; i++){
+		pushMarkWork(workers + i % threads, vm.gc.objectsQueue[i]);
+	}
+	vm.gc.count = 0;
+
+	// The vm thread counts as a participant until it is done starting the others, so marking cannot be over before that
+	participants = 1;
+	idleWorkers = 0;
+	bool* started = (bool*) malloc(sizeof(bool) * threads);
+	if (started == NULL) exit(1);
+	for (int i=1; i < threads; i++){
+		__atomic_add_fetch(&participants, 1, __ATOMIC_SEQ_CST);
+		started[i] = pthread_create(handles + i, NULL, runMarkWorker, workers + i) == 0;
+		// The other threads steal the work dealt to a thread that could not be started
+		if (!started[i]) __atomic_sub_fetch(&participants, 1, __ATOMIC_SEQ_CST);
+	}
+
+	runMarkWorker(workers);
+
+	for (int i=1; i < threads; i++){
+		if (started[i]) pthread_join(handles[i], NULL);
+	}
+	for (int i=0; i < threads; i++){
+		freeMarkDeque(&workers[i].deque);
+	}
+	free(started);
+	free(handles);
+	free(workers);
+	workers = NULL;
+	workerCount = 0;
+}
+
+#endif
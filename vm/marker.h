@@ -0,0 +1,36 @@
+#ifndef MARKER_H
+#define MARKER_H
+
+#include "../common.h"
+#include "object.h"
+
+#ifdef PARALLEL_MARKING
+
+// Chase-Lev work-stealing deque: its owner pushes and takes objects at the bottom, the other marking threads steal from the top
+// Arrays that got too small are kept until marking is over, since a thief may still be reading from them
+typedef struct MarkArray{
+	int64_t size;
+	struct MarkArray* previous;
+	Object* objects[];
+} MarkArray;
+
+typedef struct{
+	int64_t top;
+	int64_t bottom;
+	MarkArray* array;
+} MarkDeque;
+
+typedef struct{
+	MarkDeque deque;
+	unsigned int seed;
+} MarkWorker;
+
+// The worker of the current thread, NULL outside of parallel marking
+extern __thread MarkWorker* currentMarkWorker;
+
+void pushMarkWork(MarkWorker*, Object*);
+void markQueuedObjectsInParallel(int threads);
+
+#endif
+
+#endif
@@ -1,25 +1,47 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 
 #include "memory.h"
 #include "vm.h"
+#include "shape.h"
+#include "nursery.h"
+#include "slab.h"
+#include "compactor.h"
 
 extern VM vm;
 
-void * reallocate(void* pointer, int oldsize, int newsize){
+// Called before `size` more bytes are allocated: a heap that would go over its limit gets a full gc to make room,
+// and if that was not enough the allocation raises a runtime error instead
+// Dead young objects still count until a minor gc, which cannot run here: see scheduleGC
+// Minor gcs are not interrupted, they only move bytes that were already allocated to the old generation
+static void checkHeapLimit(size_t size){
+	if (vm.gc.heapLimit == 0 || vm.nursery.isCollecting || vm.gc.isDeferred || vm.bytesAllocated + (int64_t) size <= vm.gc.heapLimit) return;
 
-	vm.bytesAllocated += (newsize - oldsize);
+	runGarbageCollector();
+	if (vm.bytesAllocated + (int64_t) size <= vm.gc.heapLimit) return;
+
+	runtimeError("Out of memory: heap limit of %lld bytes exceeded", (long long) vm.gc.heapLimit);
+	longjmp(vm.heapLimitExceeded, 1);
+}
+
+// Allocations of what objects own outside of themselves are sampled by the allocation profiler
+void* reallocate(void* pointer, size_t oldsize, size_t newsize){
+	if (newsize > oldsize) SAMPLE_ALLOCATION(newsize - oldsize, PROFILE_DATA);
+	return reallocateUnsampled(pointer, oldsize, newsize);
+}
+
+// For memory the allocation profiler already sampled, like large objects (see allocateObject)
+void* reallocateUnsampled(void* pointer, size_t oldsize, size_t newsize){
+
+	if (newsize > oldsize) checkHeapLimit(newsize - oldsize);
+	vm.bytesAllocated += (int64_t) newsize - (int64_t) oldsize;
 
 	// this function is indirectly recursive since if the runGarbageCollector() is triggered, it can call the reallocate() function again while object from memory is being freed
 	// In that case, we don't want to run the garbageCollector again which is why the newsize > oldsize requirement is also there
 	// The vm.bytesAllocated >= vm.nextGCRun might not be enough because if a lot of bytes were told to be allocated, a small # of bytes being freed might still make the bytesAllocated >= nextGCRun which in turn triggers the runGarbageCollector again
-	if (newsize > oldsize && vm.bytesAllocated >= vm.nextGCRun){
-		runGarbageCollector();
-	} else{
-		#ifdef EXCESSIVE_GC_MODE
-		if (newsize > oldsize) runGarbageCollector();
-		#endif
-	}
+	// No gc can start while a minor gc is copying objects out of the nursery either
+	if (newsize > oldsize && !vm.nursery.isCollecting) stepGarbageCollector();
 
 
 	if (newsize == 0){
@@ -32,82 +54,103 @@ void * reallocate(void* pointer, int oldsize, int newsize){
 	return pointer;
 }
 
-void freeObjects(){
-	extern VM vm;
-	Object* current = vm.objects;
-	while (current != NULL){
-		Object* next = current->next;
-		freeObject(current);
-		current = next;
-	}
+// Old objects small enough for a size class of the slab take one of its slots, the others are malloc'd
+void* allocateOldObject(int size){
+	if (!IS_SLAB_OBJECT_SIZE(size)) return allocateLargeObject(size);
+
+	checkHeapLimit(size);
+	vm.bytesAllocated += size;
+	if (!vm.nursery.isCollecting) stepGarbageCollector();
+	return slabAllocate(size);
 }
 
-void freeObject(Object* object){
-	
-	#ifdef DEBUG_LOG_GC
-	printf("free object of type: %d\t", object->objectType);
-	printValue(OBJECT(object));
-	printf("\n");
-	#endif
+// Old objects are freed by sweeping the slab, this frees the ones still alive at exit
+void freeObjects(){
+	freeSlab();
+}
 
-	switch(object->objectType){
-		case OBJECT_STRING:
+// Called once `object` was copied to `copy`, and before `object` is overwritten: leaves a forwarding pointer behind
+// Pointers into the object itself, or back to it, have to follow it
+void relocateObject(Object* object, Object* copy){
+	switch (copy->objectType){
+		case OBJECT_UPVALUE:
 			{
-				ObjectString* objectString = (ObjectString*)object;
-				FREE_ARRAY(char, objectString->string, objectString->length+1);
-				reallocate(objectString, sizeof(*objectString), 0);
+				ObjectUpvalue* upvalue = (ObjectUpvalue*) copy;
+				if (upvalue->value == &((ObjectUpvalue*) object)->closedValue) upvalue->value = &upvalue->closedValue;
 			}
 			break;
-		case OBJECT_FUNCTION:
+		case OBJECT_CLASS:
+			setShapeTreeClass(((ObjectClass*) copy)->rootShape, (ObjectClass*) copy);
+			break;
+		case OBJECT_INSTANCE:
 			{
-				ObjectFunction* objectFunction = (ObjectFunction*)object;
-				freeChunk(objectFunction->chunk);
-				reallocate(objectFunction, sizeof(*objectFunction), 0);
+				ObjectInstance* instance = (ObjectInstance*) copy;
+				if (instance->fields == ((ObjectInstance*) object)->inlineFields) instance->fields = instance->inlineFields;
 			}
 			break;
-		case OBJECT_NATIVE_FUNCTION:
+		default:
+			break;
+	}
+
+	object->isForwarded = true;
+	FORWARDING_ADDRESS(object) = copy;
+}
+
+// Size of the object itself, not counting what it owns outside of it
+int objectSize(Object* object){
+	switch(object->objectType){
+		case OBJECT_STRING: return sizeof(ObjectString) + ((ObjectString*) object)->length + 1;
+		case OBJECT_FUNCTION: return sizeof(ObjectFunction);
+		case OBJECT_NATIVE_FUNCTION: return sizeof(ObjectNativeFunction);
+		case OBJECT_CLOSURE: return sizeof(ObjectClosure);
+		case OBJECT_UPVALUE: return sizeof(ObjectUpvalue);
+		case OBJECT_CLASS: return sizeof(ObjectClass);
+		case OBJECT_INSTANCE: return sizeof(ObjectInstance) + sizeof(Value) * ((ObjectInstance*) object)->inlineCapacity;
+		case OBJECT_BOUND_METHOD: return sizeof(ObjectBoundMethod);
+		case OBJECT_ROPE: return sizeof(ObjectRope);
+	}
+	return 0;
+}
+
+// Frees the memory an object owns outside of itself (character arrays, chunks, ...)
+void freeObjectContents(Object* object){
+
+	switch(object->objectType){
+		case OBJECT_FUNCTION:
 			{
-				ObjectNativeFunction* objectNativeFunction = (ObjectNativeFunction*)object;
-				reallocate(objectNativeFunction, sizeof(*objectNativeFunction), 0);
+				ObjectFunction* objectFunction = (ObjectFunction*)object;
+				freeChunk(objectFunction->chunk);
 			}
 			break;
 		case OBJECT_CLOSURE:
 			{
 				ObjectClosure* objectClosure = (ObjectClosure*) object;
 				FREE_ARRAY(ObjectUpvalue*, objectClosure->objUpvalues, objectClosure->upvaluesCount);
-				reallocate(objectClosure, sizeof(*objectClosure), 0);
-			}
-			break;
-		case OBJECT_UPVALUE:
-			{
-				ObjectUpvalue* objectUpvalue = (ObjectUpvalue*) object;
-				reallocate(objectUpvalue, sizeof(*objectUpvalue), 0);
-				
 			}
 			break;
 		case OBJECT_CLASS:
 			{
 				ObjectClass* objectClass = (ObjectClass*) object;
-				freeTable(objectClass->methods);
-				reallocate(objectClass->methods, sizeof(*objectClass->methods), 0);
-				reallocate(objectClass, sizeof(*objectClass), 0);
+				FREE_ARRAY(ObjectClosure*, objectClass->vtable, objectClass->vtableSize);
+				freeShapeTree(objectClass->rootShape);
 			}
 			break;
 		case OBJECT_INSTANCE:
 			{
 				ObjectInstance* objectInstance = (ObjectInstance*) object;
-				freeTable(objectInstance->fields);
-				reallocate(objectInstance->fields, sizeof(*objectInstance->fields), 0);
-				reallocate(objectInstance, sizeof(*objectInstance), 0);
+				if (objectInstance->fields != objectInstance->inlineFields) FREE_ARRAY(Value, objectInstance->fields, objectInstance->fieldCapacity);
+				if (objectInstance->dictionary != NULL){
+					freeTable(objectInstance->dictionary);
+					reallocate(objectInstance->dictionary, sizeof(*objectInstance->dictionary), 0);
+				}
 			}
 			break;
+		case OBJECT_NATIVE_FUNCTION:
+		case OBJECT_UPVALUE:
+		case OBJECT_STRING:
 		case OBJECT_BOUND_METHOD:
-			{
-				ObjectBoundMethod* objectBoundMethod = (ObjectBoundMethod*) object;
-				reallocate(objectBoundMethod, sizeof(*objectBoundMethod), 0);
-			}
-			break;
-		default:
+		case OBJECT_ROPE:
+			// Nothing outside of the object
 			break;
 	}
 
@@ -115,33 +158,182 @@ void freeObject(Object* object){
 
 
 // Garbage collector functions
-void runGarbageCollector(){
-	initGC();
-
-	int bytesBefore = vm.bytesAllocated;
 
+// Marks whatever is left, then hands the old generation over to the sweeper
+// Called with the queue holding the rest of an incremental cycle, or empty for a stop the world collection
+static void finishMarking(){
 	#ifdef DEBUG_LOG_GC
 	printf("--- GC run --\n");
 	printf("- Marking objects -\n");
 	#endif
 
+	// The roots are marked again: the mutator changes them without any write barrier
+	vm.gc.state = GC_IDLE;
 	markObjects();
+
+	// Weak references to the dead objects go before the mutator runs again, the objects themselves are freed as they get swept
 	freeStringsFromVMHashTable();
+	#ifdef GENERATIONAL_GC
+	sweepRememberedSet();
+	clearNurseryMarks();
+	#endif
+	resetGC();
 
 	#ifdef DEBUG_LOG_GC
 	printf("- Sweeping unreachable objects -\n");
 	#endif
-	sweepObjects();
 
+	// Only the old generation is swept, young objects are freed by minor gcs
+	startSlabSweep();
+	vm.gc.state = GC_SWEEPING;
+}
+
+// Sweeps at most `budget` objects (slots of the slab pages included), and ends the cycle once every object was swept
+static void sweepLazily(int budget){
+	double start = currentTime();
+	bool isDone = sweepObjects(budget);
+	vm.gc.stats.current.sweepTime += currentTime() - start;
+	if (!isDone) return;
+
+	vm.gc.state = GC_IDLE;
+	finishCycleStats();
 
 	// Set the next GC run
-	 vm.nextGCRun = (vm.bytesAllocated * 2 <= INITIAL_GC_TRIGGER_VALUE) ? INITIAL_GC_TRIGGER_VALUE : 2 * vm.bytesAllocated;
-	
-	resetGC();
+	int64_t heapSize = (int64_t) (vm.bytesAllocated * vm.gc.growthFactor);
+	scheduleGC(heapSize < vm.gc.minHeap ? vm.gc.minHeap : heapSize);
+	considerCompaction();
 
 	#ifdef DEBUG_LOG_GC
-	int bytesAfter = vm.bytesAllocated;
-	printf("- Bytes freed from memory: %d -\n", bytesBefore - bytesAfter);
+	printf("- Bytes freed from memory: %lld -\n", (long long) vm.gc.stats.current.bytesFreed);
 	printf("--- GC end ---\n");
 	#endif
 }
+
+// The next gc runs once `heapSize` bytes are allocated
+// With a heap limit it starts no later than at 3/4 of it: the minor gc every gc asks for is then likely to free the dead young objects,
+// which an allocation over the limit cannot do
+void scheduleGC(int64_t heapSize){
+	if (vm.gc.heapLimit != 0 && heapSize > vm.gc.heapLimit / 4 * 3) heapSize = vm.gc.heapLimit / 4 * 3;
+	vm.nextGCRun = heapSize;
+}
+
+// Dead young objects keep what they own outside of the nursery (character arrays, ...) until a minor gc, which no major gc can free
+// Every major gc also asks for a minor gc at the next safepoint, or a heap of mostly young garbage would keep triggering them
+static void requestMinorGC(){
+	#ifdef GENERATIONAL_GC
+	vm.nursery.isFull = true;
+	#endif
+}
+
+// Stops the world until a whole collection is over
+// A cycle that is still marking is finished, and one that is still sweeping is finished before a new one starts
+void runGarbageCollector(){
+	double start = currentTime();
+	if (vm.gc.state == GC_SWEEPING) sweepLazily(INT_MAX);
+	if (vm.gc.state == GC_IDLE) startCycleStats();
+
+	double markStart = currentTime();
+	finishMarking();
+	vm.gc.stats.current.markTime += currentTime() - markStart;
+	sweepLazily(INT_MAX);
+	requestMinorGC();
+	recordPause(start);
+}
+
+// Starts a cycle: an incremental one only marks the roots, the rest of the heap is marked by the slices
+// Otherwise the whole heap is marked at once, and only the sweeping is left for the slices
+static void startCycle(){
+	double start = currentTime();
+	startCycleStats();
+	requestMinorGC();
+
+	#ifdef INCREMENTAL_GC
+	// Several marking threads are fast enough to mark the whole heap at once
+	if (vm.gc.markThreads == 1){
+		#ifdef DEBUG_LOG_GC
+		printf("--- GC cycle start --\n");
+		#endif
+
+		vm.gc.state = GC_MARKING;
+		markRoots();
+		markCompilerRoots();
+	} else finishMarking();
+	#else
+	finishMarking();
+	#endif
+
+	vm.gc.nextSlice = vm.bytesAllocated + GC_SLICE_ALLOCATION;
+	vm.gc.stats.current.markTime += currentTime() - start;
+	recordPause(start);
+}
+
+// Marks `sliceBudget` bytes of objects, or sweeps at most GC_SWEEP_BUDGET objects once marking is over, per GC_SLICE_ALLOCATION bytes allocated
+static void runSlice(){
+	double start = currentTime();
+	vm.gc.stats.slices++;
+
+	#ifdef DEBUG_LOG_GC
+	printf("--- GC slice --\n");
+	#endif
+
+	// The work done keeps up with the allocations: a minor gc can promote several GC_SLICE_ALLOCATION bytes at once
+	// At most GC_MAX_SLICE_STEPS of them, which bounds the pause: the next slice is then already due, and the work left is spread over the following allocations
+	int64_t steps = 1;
+	if (vm.bytesAllocated > vm.gc.nextSlice) steps += (vm.bytesAllocated - vm.gc.nextSlice) / GC_SLICE_ALLOCATION;
+	if (steps > GC_MAX_SLICE_STEPS) steps = GC_MAX_SLICE_STEPS;
+
+	if (vm.gc.state == GC_MARKING){
+		if (markQueuedObjects(vm.gc.sliceBudget * (int) steps)) finishMarking();
+		vm.gc.stats.current.markTime += currentTime() - start;
+	} else{
+		sweepLazily(GC_SWEEP_BUDGET * (int) steps);
+	}
+	vm.gc.nextSlice += steps * GC_SLICE_ALLOCATION;
+	vm.gc.isSliceOverdue = vm.gc.state != GC_IDLE && vm.bytesAllocated >= vm.gc.nextSlice;
+	recordPause(start);
+}
+
+// Moves the objects of the sparsest slab pages to the densest ones, and releases the emptied pages
+// Only called at a safepoint, and after a minor gc emptied the nursery
+void compactHeap(){
+	// A cycle that is still marking knows nothing of forwarding pointers, it asks for another compaction once it is over
+	if (vm.gc.state == GC_SWEEPING) sweepLazily(INT_MAX);
+	vm.gc.isCompactionPending = false;
+	if (vm.gc.state != GC_IDLE) return;
+
+	double start = currentTime();
+	evacuateSparsePages();
+	updateReferences();
+	vm.gc.stats.releasedPages += releaseEvacuatedPages();
+	vm.gc.stats.compactions++;
+	vm.gc.stats.compactTime += currentTime() - start;
+	recordPause(start);
+}
+
+// Called on allocations: starts a gc cycle once the heap grew past the next gc run
+// The cycle then advances by one slice every GC_SLICE_ALLOCATION bytes until it is over
+void stepGarbageCollector(){
+	if (vm.gc.isDeferred) return;
+
+	#ifdef EXCESSIVE_GC_MODE
+	bool cycleDue = true, sliceDue = true;
+	#else
+	bool cycleDue = vm.bytesAllocated >= vm.nextGCRun, sliceDue = vm.bytesAllocated >= vm.gc.nextSlice;
+	#endif
+
+	switch (vm.gc.state){
+		case GC_IDLE:
+			if (cycleDue) startCycle();
+			break;
+		case GC_MARKING:
+			// The mutator allocates faster than even the slices running on every allocation mark, finish the cycle before the heap grows any further
+			if (vm.bytesAllocated >= 2 * vm.nextGCRun){
+				vm.gc.stats.emergencyCollections++;
+				runGarbageCollector();
+			} else if (sliceDue) runSlice();
+			break;
+		case GC_SWEEPING:
+			if (sliceDue) runSlice();
+			break;
+	}
+}
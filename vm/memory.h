@@ -15,11 +15,18 @@
 #define FREE_ARRAY(type, pointer, oldsize) \
        	reallocate(pointer, sizeof(type) * oldsize, 0)
 
-void* reallocate(void*, int, int);
+void* reallocate(void*, size_t, size_t);
+void* reallocateUnsampled(void*, size_t, size_t);
 
+void* allocateOldObject(int size);
 void freeObjects();
-void freeObject(Object* object);
+void relocateObject(Object* object, Object* copy);
+void freeObjectContents(Object*);
+int objectSize(Object*);
 
 // Garbage collector functions
+void scheduleGC(int64_t heapSize);
 void runGarbageCollector();
+void stepGarbageCollector();
+void compactHeap();
 #endif
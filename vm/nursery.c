@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nursery.h"
+#include "memory.h"
+#include "vm.h"
+#include "shape.h"
+#include "../compiler/compiler.h"
+
+extern VM vm;
+
+#ifdef GENERATIONAL_GC
+
+// Young objects are bump allocated on 8 byte boundaries, so the nursery can be walked one object after the other
+#define ALIGN_SIZE(size) (((size) + 7) & ~7)
+// Bigger objects go straight to the old generation instead of filling the nursery
+#define MAX_YOUNG_OBJECT_SIZE (NURSERY_SIZE / 8)
+
+// The forwarding pointer of a promoted object may have overwritten what its size is computed from, its copy has the same size
+#define YOUNG_OBJECT_SIZE(object) objectSize((object)->isForwarded ? FORWARDING_ADDRESS(object) : (object))
+#define NEXT_YOUNG_OBJECT(object) ((Object*) ((uint8_t*) (object) + ALIGN_SIZE(YOUNG_OBJECT_SIZE(object))))
+#define NURSERY_MARK_WORDS (NURSERY_SIZE / 8 / 64)
+
+static Object* evacuate(Object*);
+static void evacuateValue(Value*);
+static void evacuateTable(Table*);
+static void evacuateRoots();
+static void scanObject(Object*);
+static void sweepNursery();
+static void forwardObjects(Object**, int*);
+
+void initNursery(){
+	vm.nursery.start = (uint8_t*) malloc(NURSERY_SIZE);
+	vm.nursery.marks = (uint64_t*) calloc(NURSERY_MARK_WORDS, sizeof(uint64_t));
+	if (vm.nursery.start == NULL || vm.nursery.marks == NULL) exit(1);
+	vm.nursery.top = vm.nursery.start;
+	vm.nursery.end = vm.nursery.start + NURSERY_SIZE;
+	vm.nursery.isFull = false;
+	vm.nursery.isCollecting = false;
+
+	vm.nursery.rememberedCount = 0;
+	vm.nursery.rememberedCapacity = 0;
+	vm.nursery.remembered = NULL;
+
+	vm.nursery.promotedCount = 0;
+	vm.nursery.promotedCapacity = 0;
+	vm.nursery.promoted = NULL;
+}
+
+void freeNursery(){
+	// Young objects still own their character arrays, chunks, ... (unless they were promoted, then the copy owns them)
+	for (Object* object = (Object*) vm.nursery.start; (uint8_t*) object < vm.nursery.top; object = NEXT_YOUNG_OBJECT(object)){
+		if (!object->isForwarded) freeObjectContents(object);
+	}
+
+	free(vm.nursery.start);
+	free(vm.nursery.marks);
+	free(vm.nursery.remembered);
+	free(vm.nursery.promoted);
+	vm.nursery.start = vm.nursery.top = vm.nursery.end = NULL;
+	vm.nursery.marks = NULL;
+	vm.nursery.remembered = NULL;
+	vm.nursery.promoted = NULL;
+}
+
+// Returns NULL if the object has to be allocated in the old generation
+Object* allocateYoungObject(int size){
+	size = ALIGN_SIZE(size);
+	if (size > MAX_YOUNG_OBJECT_SIZE) return NULL;
+
+	if (size > vm.nursery.end - vm.nursery.top){
+		vm.nursery.isFull = true;
+		return NULL;
+	}
+
+	Object* object = (Object*) vm.nursery.top;
+	vm.nursery.top += size;
+
+	#ifdef EXCESSIVE_GC_MODE
+	vm.nursery.isFull = true;
+	#endif
+
+	return object;
+}
+
+void rememberObject(Object* object){
+	if (vm.nursery.rememberedCount == vm.nursery.rememberedCapacity){
+		vm.nursery.rememberedCapacity = GROW_CAPACITY(vm.nursery.rememberedCapacity);
+		vm.nursery.remembered = (Object**) realloc(vm.nursery.remembered, sizeof(Object*) * vm.nursery.rememberedCapacity);
+		if (vm.nursery.remembered == NULL) exit(1);
+	}
+
+	object->isRemembered = true;
+	vm.nursery.remembered[vm.nursery.rememberedCount++] = object;
+}
+
+static void addPromotedObject(Object* object){
+	if (vm.nursery.promotedCount == vm.nursery.promotedCapacity){
+		vm.nursery.promotedCapacity = GROW_CAPACITY(vm.nursery.promotedCapacity);
+		vm.nursery.promoted = (Object**) realloc(vm.nursery.promoted, sizeof(Object*) * vm.nursery.promotedCapacity);
+		if (vm.nursery.promoted == NULL) exit(1);
+	}
+
+	vm.nursery.promoted[vm.nursery.promotedCount++] = object;
+}
+
+// Minor gc: copies every young object reachable from the roots or the remembered set into the old generation
+// Objects move, so this must only run where the vm keeps no object pointers in C locals (see the safepoints in runVM)
+void collectNursery(){
+	double start = currentTime();
+
+	#ifdef DEBUG_LOG_GC
+	printf("--- minor GC run --\n");
+	int64_t bytesBefore = vm.bytesAllocated;
+	#endif
+
+	vm.nursery.isCollecting = true;
+
+	evacuateRoots();
+
+	// Scanning can remember some of the objects again, which only ever moves entries to indexes that were already scanned
+	int rememberedCount = vm.nursery.rememberedCount;
+	vm.nursery.rememberedCount = 0;
+	for (int i=0; i < rememberedCount; i++){
+		Object* object = vm.nursery.remembered[i];
+		object->isRemembered = false;
+		scanObject(object);
+	}
+
+	// The promoted objects still need to be scanned, and the list grows while it is scanned
+	for (int i=0; i < vm.nursery.promotedCount; i++){
+		scanObject(vm.nursery.promoted[i]);
+	}
+	vm.nursery.promotedCount = 0;
+
+	// An incremental cycle in progress keeps young objects queued, they follow the promoted copies (or are dropped with the dead ones)
+	if (vm.gc.state == GC_MARKING){
+		forwardObjects(vm.gc.objectsQueue, &vm.gc.count);
+		forwardObjects((Object**) vm.gc.openUpvalues, &vm.gc.openUpvaluesCount);
+	}
+
+	sweepNursery();
+	// New objects get the addresses of the dead ones, but not their marks
+	clearNurseryMarks();
+	vm.nursery.top = vm.nursery.start;
+	vm.nursery.isFull = false;
+
+	vm.nursery.isCollecting = false;
+
+	vm.gc.stats.minorCollections++;
+	vm.gc.stats.minorTime += currentTime() - start;
+	recordPause(start);
+
+	#ifdef DEBUG_LOG_GC
+	printf("- Bytes promoted: %lld -\n", (long long) (vm.bytesAllocated - bytesBefore));
+	printf("--- minor GC end ---\n");
+	#endif
+
+	// Promoted objects count towards the old generation, which may now need a full gc of its own
+	stepGarbageCollector();
+	// Old objects can only move at the same safepoints as the young ones
+	if (vm.gc.isCompactionPending) compactHeap();
+}
+
+// Called by the full gc before sweeping: remembered objects that are about to be freed must be forgotten
+void sweepRememberedSet(){
+	int count = 0;
+	for (int i=0; i < vm.nursery.rememberedCount; i++){
+		Object* object = vm.nursery.remembered[i];
+		if (isObjectMarked(object)) vm.nursery.remembered[count++] = object;
+	}
+	vm.nursery.rememberedCount = count;
+}
+
+// The full gc marks young objects too, but only sweeps the old generation
+void clearNurseryMarks(){
+	size_t words = ((vm.nursery.top - vm.nursery.start) / 8 + 63) / 64;
+	memset(vm.nursery.marks, 0, words * sizeof(uint64_t));
+}
+
+// Returns the address of the object after the minor gc, promoting it the first time a young object is reached
+static Object* evacuate(Object* object){
+	if (object == NULL || !IS_YOUNG(object)) return object;
+	if (object->isForwarded) return FORWARDING_ADDRESS(object);
+
+	int size = objectSize(object);
+	Object* copy = (Object*) allocateOldObject(size);
+	memcpy(copy, object, size);
+	vm.gc.stats.bytesPromoted += size;
+	copy->isLarge = !IS_SLAB_OBJECT_SIZE(size);
+	// An incremental cycle already scanned the object if it is marked, its copy must not look white
+	if (vm.gc.state == GC_MARKING && isObjectMarked(object)) setObjectMark(copy);
+	relocateObject(object, copy);
+
+	addPromotedObject(copy);
+	return copy;
+}
+
+static void evacuateValue(Value* value){
+	if (IS_OBJ(*value)) *value = OBJECT(evacuate(AS_OBJ(*value)));
+}
+
+static void evacuateTable(Table* table){
+	for (int i=0; i < table->capacity; i++){
+		if (TABLE_KEY(table, i) == NULL) continue;
+		TABLE_KEY(table, i) = (ObjectString*) evacuate((Object*) TABLE_KEY(table, i));
+		evacuateValue(&TABLE_VALUE(table, i));
+	}
+}
+
+static void evacuateRoots(){
+	vm.init = (ObjectString*) evacuate((Object*) vm.init);
+
+	for (int i=0; i < vm.selectorNames.count; i++){
+		evacuateValue(vm.selectorNames.values + i);
+	}
+
+	// Globals are roots, so their setters need no write barrier
+	evacuateTable(&vm.globalSlots);
+	for (int i=0; i < vm.globalValues.count; i++){
+		evacuateValue(vm.globalValues.values + i);
+	}
+	for (int i=0; i < vm.globalNames.count; i++){
+		evacuateValue(vm.globalNames.values + i);
+	}
+
+	for (Value* slot = vm.stack; slot < vm.stackpointer; slot++){
+		evacuateValue(slot);
+	}
+	for (int i=0; i < vm.frameCount; i++){
+		vm.frames[i].closure = (ObjectClosure*) evacuate((Object*) vm.frames[i].closure);
+	}
+	for (int i=0; i < STACK_MAX_SIZE; i++){
+		vm.openObjUpvalues[i] = (ObjectUpvalue*) evacuate((Object*) vm.openObjUpvalues[i]);
+	}
+
+	extern Compiler* currentCompiler;
+	for (Compiler* compiler = currentCompiler; compiler != NULL; compiler = compiler->parentCompiler){
+		compiler->function = (ObjectFunction*) evacuate((Object*) compiler->function);
+	}
+}
+
+static void evacuateShapeTree(Shape* shape){
+	shape->key = (ObjectString*) evacuate((Object*) shape->key);
+	for (Shape* child = shape->firstChild; child != NULL; child = child->nextSibling){
+		evacuateShapeTree(child);
+	}
+}
+
+// Updates every reference of an old object to young objects
+static void scanObject(Object* object){
+
+	switch(object->objectType){
+		case OBJECT_NATIVE_FUNCTION:
+			{
+				ObjectNativeFunction* objNative = (ObjectNativeFunction*) object;
+				objNative->name = (ObjectString*) evacuate((Object*) objNative->name);
+			}
+			break;
+		case OBJECT_FUNCTION:
+			{
+				ObjectFunction* objFunc = (ObjectFunction*) object;
+				objFunc->name = (ObjectString*) evacuate((Object*) objFunc->name);
+
+				ValueArray* constants = &(objFunc->chunk->constants);
+				for (int i=0; i < constants->count; i++){
+					evacuateValue(constants->values + i);
+				}
+
+				for (int i=0; i < objFunc->chunk->cacheCount; i++){
+					InlineCache* cache = objFunc->chunk->caches + i;
+					cache->Class = (ObjectClass*) evacuate((Object*) cache->Class);
+					cache->method = (ObjectClosure*) evacuate((Object*) cache->method);
+					// Shapes are not objects, but the class owning them may move
+					if (cache->shape != NULL) evacuate((Object*) cache->shape->Class);
+				}
+			}
+			break;
+		case OBJECT_CLOSURE:
+			{
+				ObjectClosure* objClosure = (ObjectClosure*) object;
+				objClosure->function = (ObjectFunction*) evacuate((Object*) objClosure->function);
+				for (int i=0; i < objClosure->upvaluesCount; i++){
+					objClosure->objUpvalues[i] = (ObjectUpvalue*) evacuate((Object*) objClosure->objUpvalues[i]);
+				}
+			}
+			break;
+		case OBJECT_UPVALUE:
+			{
+				// Open upvalues point into the stack, which is a root
+				// They stay remembered until they are closed, so that closing them needs no write barrier
+				ObjectUpvalue* objUpvalue = (ObjectUpvalue*) object;
+				if (objUpvalue->value == &objUpvalue->closedValue) evacuateValue(&objUpvalue->closedValue);
+				else if (!object->isRemembered) rememberObject(object);
+			}
+			break;
+		case OBJECT_CLASS:
+			{
+				ObjectClass* objClass = (ObjectClass*) object;
+				objClass->name = (ObjectString*) evacuate((Object*) objClass->name);
+				objClass->superclass = (ObjectClass*) evacuate((Object*) objClass->superclass);
+				objClass->initializer = (ObjectClosure*) evacuate((Object*) objClass->initializer);
+				for (int i=0; i < objClass->vtableSize; i++){
+					objClass->vtable[i] = (ObjectClosure*) evacuate((Object*) objClass->vtable[i]);
+				}
+				evacuateShapeTree(objClass->rootShape);
+			}
+			break;
+		case OBJECT_INSTANCE:
+			{
+				ObjectInstance* objInstance = (ObjectInstance*) object;
+				objInstance->Class = (ObjectClass*) evacuate((Object*) objInstance->Class);
+				if (IS_DICTIONARY_MODE(objInstance)){
+					evacuateTable(objInstance->dictionary);
+				} else{
+					for (int i=0; i < objInstance->shape->fieldCount; i++){
+						evacuateValue(objInstance->fields + i);
+					}
+				}
+			}
+			break;
+		case OBJECT_BOUND_METHOD:
+			{
+				ObjectBoundMethod* boundMethod = (ObjectBoundMethod*) object;
+				boundMethod->closure = (ObjectClosure*) evacuate((Object*) boundMethod->closure);
+				boundMethod->instance = (ObjectInstance*) evacuate((Object*) boundMethod->instance);
+			}
+			break;
+		case OBJECT_ROPE:
+			{
+				ObjectRope* rope = (ObjectRope*) object;
+				rope->left = evacuate(rope->left);
+				rope->right = evacuate(rope->right);
+				rope->flat = (ObjectString*) evacuate((Object*) rope->flat);
+			}
+			break;
+		case OBJECT_STRING:
+			// Nothing to do
+			break;
+	}
+}
+
+// Replaces the young objects of the list with their promoted copy, and removes the ones that died
+static void forwardObjects(Object** objects, int* count){
+	int kept = 0;
+	for (int i=0; i < *count; i++){
+		Object* object = objects[i];
+		if (IS_YOUNG(object)) object = object->isForwarded ? FORWARDING_ADDRESS(object) : NULL;
+		if (object != NULL) objects[kept++] = object;
+	}
+	*count = kept;
+}
+
+// Walks the nursery after the live objects were promoted: the interned strings table follows the promoted strings,
+// and the objects left behind are dead, so the memory they own outside of the nursery is freed
+static void sweepNursery(){
+	for (Object* object = (Object*) vm.nursery.start; (uint8_t*) object < vm.nursery.top; object = NEXT_YOUNG_OBJECT(object)){
+		if (object->objectType == OBJECT_STRING){
+			ObjectString* string = (ObjectString*) object;
+			if (object->isForwarded){
+				// Only the hash of the string is read, which the forwarding pointer did not overwrite
+				tableReplaceKey(&vm.strings, string, (ObjectString*) FORWARDING_ADDRESS(object));
+			} else{
+				tableDelete(&vm.strings, string);
+			}
+		}
+
+		if (!object->isForwarded){
+			// The nursery itself is not part of the heap size, only what young objects own outside of it
+			int size = objectSize(object);
+			int64_t bytesBefore = vm.bytesAllocated;
+			freeObjectContents(object);
+			vm.gc.stats.freedObjects[object->objectType]++;
+			vm.gc.stats.youngBytesFreed += size + bytesBefore - vm.bytesAllocated;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef NURSERY_H
+#define NURSERY_H
+
+#include "../common.h"
+#include "object.h"
+#include "value.h"
+
+// The young generation: new objects are bump allocated in a fixed size nursery
+// A minor gc copies the ones still reachable out of it (promotes them to the old generation, the slab)
+// and then starts allocating from the beginning of the nursery again
+// Old objects that get a reference to a young object are recorded in the remembered set by the write barrier,
+// so that a minor gc only has to scan the roots, the remembered objects and the promoted objects instead of the whole heap
+typedef struct{
+	uint8_t* start;
+	uint8_t* top;
+	uint8_t* end;
+	// Mark bits of the young objects for the full gc, one per 8 bytes of the nursery
+	uint64_t* marks;
+
+	// Set once an allocation did not fit, the minor gc then runs at the next safepoint of the vm loop
+	bool isFull;
+	// Set while a minor gc is copying objects, no gc can start in the meantime
+	bool isCollecting;
+
+	int rememberedCount;
+	int rememberedCapacity;
+	Object** remembered;
+
+	// Promoted objects that still need to be scanned by the minor gc
+	int promotedCount;
+	int promotedCapacity;
+	Object** promoted;
+} Nursery;
+
+#ifdef GENERATIONAL_GC
+
+#define IS_YOUNG(object) ((uintptr_t) ((uint8_t*) (object) - vm.nursery.start) < NURSERY_SIZE)
+
+// Remembers the old `owner` when a young `object` is stored in one of its fields
+#define REMEMBER_BARRIER(owner, object) \
+		do { \
+			if (IS_YOUNG(object) && !((Object*) (owner))->isRemembered && !IS_YOUNG(owner)) rememberObject((Object*) (owner)); \
+		} while (false)
+
+#else
+
+#define IS_YOUNG(object) false
+#define REMEMBER_BARRIER(owner, object) do {} while (false)
+
+#endif
+
+// function prototypes
+void initNursery();
+void freeNursery();
+Object* allocateYoungObject(int);
+void rememberObject(Object*);
+void collectNursery();
+void sweepRememberedSet();
+void clearNurseryMarks();
+
+#endif
@@ -1,74 +1,92 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "object.h"
 #include "memory.h"
 #include "string.h"
 #include "vm.h"
+#include "shape.h"
 
 extern VM vm;
 
 Object * allocateObject(int size, ObjectType type){
-	extern VM vm;
-	Object* object = (Object*) reallocate(NULL,0,size);
+	Object* object = NULL;
+
+	#ifdef GENERATIONAL_GC
+	// Otherwise only minor gcs would advance a cycle that fell behind, by one bounded slice each
+	if (vm.gc.isSliceOverdue) stepGarbageCollector();
+	object = allocateYoungObject(size);
+	#endif
+
+	bool isOld = object == NULL;
+	if (isOld) object = (Object*) allocateOldObject(size);
+
 	object->objectType = type;
+	object->isRemembered = false;
+	object->isForwarded = false;
+	object->isLarge = isOld && !IS_SLAB_OBJECT_SIZE(size);
 
-	object->next = vm.objects;
-	object->isMarked = false;
+	#ifdef GENERATIONAL_GC
+	// Old objects only get allocated while the nursery is full (or for big objects): their fields are about to be set to young objects
+	if (isOld) rememberObject(object);
+	#endif
 
 	#ifdef DEBUG_LOG_GC
 	printf("Allocate object of type %d\n", type);
 	#endif
 
-	vm.objects = object;
-
+	SAMPLE_ALLOCATION(size, type);
 	return object;
 }
 
-ObjectString* makeStringObject(const char* start, int length){
-
-	char* string = (char*) reallocate(NULL,0,length+1);
-	memcpy(string, start, length);
-	string[length] = '\0';
-	return allocateStringObject(string, length);
+// Name of the type in heap snapshots and allocation profiles
+const char* objectTypeName(ObjectType type){
+	static const char* names[OBJECT_TYPE_COUNT] = {
+		"string", "function", "native", "closure", "upvalue", "class", "instance", "bound_method", "rope",
+	};
+	return names[type];
 }
 
-ObjectString* allocateStringObject(char* string, int length){
+// Allocates a string of `length` characters for the caller to fill, the characters follow the header in the same allocation
+static ObjectString* allocateStringObject(int length){
+	ObjectString* objString = (ObjectString*) allocateObject(sizeof(ObjectString) + length + 1, OBJECT_STRING);
+	objString->length = length;
+	objString->hash = 0;
+	objString->selector = -1;
+	objString->string[length] = '\0';
+	return objString;
+}
 
-	uint32_t hash = jenkinsHash(string, length);
-	ObjectString* interned = tableFindString(&vm.strings, string, length, hash);
+ObjectString* makeStringObject(const char* start, int length){
 
-	if (interned == NULL){
+	// Interned strings are found without allocating anything
+	uint32_t hash = hashString(start, length);
+	ObjectString* interned = tableFindString(&vm.strings, start, length, hash);
+	if (interned != NULL) return interned;
 
-		ObjectString* objString = (ObjectString *) allocateObject(sizeof(ObjectString), OBJECT_STRING);
-		objString->string = string;
-		objString->length = length;
-		objString->hash = hash; 
+	ObjectString* objString = allocateStringObject(length);
+	memcpy(objString->string, start, length);
+	objString->hash = hash;
 
-		// Add to hash set
-		tableAdd(&vm.strings, objString, NIL);
-		return objString;
-	}
-	else {
-		FREE_ARRAY(char, string, length + 1);
-		return interned;
-	}
+	// Add to hash set, pushed in the off chance the gc runs while the table grows
+	push(OBJECT(objString));
+	tableAdd(&vm.strings, objString, NIL);
+	pop();
+	return objString;
 }
 
 ObjectFunction* makeNewFunctionObject(FunctionType type){
 
+	// Allocate the chunk first: if the gc ran while allocating it, it would find the function object with an uninitialized chunk
+	Chunk* chunk = (Chunk*) reallocate(NULL,0,sizeof(Chunk));
+	initChunk(chunk);
+
 	ObjectFunction* objFunction = (ObjectFunction *) allocateObject(sizeof(ObjectFunction), OBJECT_FUNCTION);
 	objFunction->name = NULL;
 	objFunction->arity = 0;
 	objFunction->upvaluesCount = 0;
 	objFunction->type = type;
-
-	// Push beforehand in the off chance the gc runs and we lose the function object
-	push(OBJECT(objFunction));
-	objFunction->chunk = (Chunk*) reallocate(NULL,0,sizeof(Chunk));
-	// pop afterwards
-	pop();
-
-	initChunk(objFunction->chunk);
+	objFunction->chunk = chunk;
 
 	return objFunction;
 }
@@ -76,22 +94,20 @@ ObjectFunction* makeNewFunctionObject(FunctionType type){
 ObjectClosure* makeNewFunctionClosureObject(ObjectFunction* function){
 	// Push beforehand in the off chance the gc runs and we lose the function object
 	push(OBJECT(function));
-	ObjectClosure* objFuncClosure = (ObjectClosure *) allocateObject(sizeof(ObjectClosure), OBJECT_CLOSURE);
 
+	// Allocate the upvalues array first: if the gc ran while allocating it, it would find the closure object with an uninitialized array
+	ObjectUpvalue** objUpvalues = reallocate(NULL, 0, (sizeof(ObjectUpvalue*) * function->upvaluesCount));
+	for (int i = 0; i < function->upvaluesCount; i++){
+		objUpvalues[i] = NULL;
+	}
 
-	objFuncClosure->function = function;
-	objFuncClosure->upvaluesCount = function->upvaluesCount;
-
-	// Push beforehand in the off chance the gc runs and we lose the function closure object
-	push(OBJECT(objFuncClosure));
-	objFuncClosure->objUpvalues = reallocate(NULL, 0, (sizeof(ObjectUpvalue*) * function->upvaluesCount));
+	ObjectClosure* objFuncClosure = (ObjectClosure *) allocateObject(sizeof(ObjectClosure), OBJECT_CLOSURE);
 	// pop afterwards
 	pop();
-	pop();
-	
-	for (int i = 0; i < function->upvaluesCount; i++){
-		objFuncClosure->objUpvalues[i] = NULL;
-	}
+
+	objFuncClosure->function = function;
+	objFuncClosure->upvaluesCount = function->upvaluesCount;
+	objFuncClosure->objUpvalues = objUpvalues;
 
 	return objFuncClosure;
 }
@@ -123,24 +139,69 @@ ObjectUpvalue* makeNewUpvalueObject(int index){
 }
 
 ObjectClass* makeClassObject(ObjectString* name){
+	// Allocate the root shape first: if the gc ran while allocating it, it would find the class object uninitialized
+	Shape* rootShape = makeRootShape();
+
 	ObjectClass* class =(ObjectClass*) allocateObject(sizeof(ObjectClass), OBJECT_CLASS);
 	class->name = name;
-
-	Table* methods = reallocate(NULL, 0, sizeof(Table));
-	initTable(methods);
-	class->methods = methods;
+	class->vtable = NULL;
+	class->vtableSize = 0;
+	class->initializer = NULL;
 	class->superclass = NULL;
+	class->version = 0;
+	class->fieldShadowsMethod = false;
+	class->rootShape = rootShape;
+	class->shapeCount = 1;
+	class->instanceSize = 0;
+	rootShape->Class = class;
 
 	return class;
 }
 
+static void growVtable(ObjectClass* class, int size){
+	if (size <= class->vtableSize) return;
+
+	// The gc can run while allocating, so only switch to the new vtable once it is filled
+	ObjectClosure** vtable = (ObjectClosure**) reallocate(NULL, 0, sizeof(ObjectClosure*) * size);
+	for (int i=0; i < size; i++){
+		vtable[i] = (i < class->vtableSize) ? class->vtable[i] : NULL;
+	}
+	FREE_ARRAY(ObjectClosure*, class->vtable, class->vtableSize);
+	class->vtable = vtable;
+	class->vtableSize = size;
+}
+
+void setMethod(ObjectClass* class, ObjectString* name, ObjectClosure* method){
+	int selector = getSelector(name);
+	growVtable(class, selector + 1);
+	class->vtable[selector] = method;
+	if (name == vm.init) class->initializer = method;
+	WRITE_BARRIER(class, OBJECT(method));
+}
+
+// Copies every method of the superclass into the class vtable
+void inheritMethods(ObjectClass* class, ObjectClass* superclass){
+	growVtable(class, superclass->vtableSize);
+	for (int i=0; i < superclass->vtableSize; i++){
+		if (superclass->vtable[i] != NULL){
+			class->vtable[i] = superclass->vtable[i];
+			WRITE_BARRIER(class, OBJECT(class->vtable[i]));
+		}
+	}
+	if (superclass->initializer != NULL) class->initializer = superclass->initializer;
+}
+
 ObjectInstance* makeInstanceObject(ObjectClass* Class){
-	ObjectInstance* instance =(ObjectInstance*) allocateObject(sizeof(ObjectInstance), OBJECT_INSTANCE);
-	instance->Class = Class;
+	// Reserve inline slots for as many fields as the largest instance of the class has had so far
+	int inlineCapacity = Class->instanceSize;
 
-	Table* fields = reallocate(NULL, 0, sizeof(Table));
-	initTable(fields);
-	instance->fields = fields;
+	ObjectInstance* instance =(ObjectInstance*) allocateObject(sizeof(ObjectInstance) + sizeof(Value) * inlineCapacity, OBJECT_INSTANCE);
+	instance->Class = Class;
+	instance->shape = Class->rootShape;
+	instance->fields = instance->inlineFields;
+	instance->fieldCapacity = inlineCapacity;
+	instance->inlineCapacity = inlineCapacity;
+	instance->dictionary = NULL;
 
 	return instance;
 }
@@ -152,20 +213,129 @@ ObjectBoundMethod* makeBoundMethodObject(ObjectClosure* closure, ObjectInstance*
 	return boundMethod;
 }
 
-uint32_t jenkinsHash(const char* key, int length){
-	// Jenkins hash function
-	// Reference: https://en.wikipedia.org/wiki/Jenkins_hash_function
+// `a + b` for two strings or ropes, pushed on the stack by the caller in the off chance the gc runs
+// Short results are copied into a string right away, the others make a rope: short strings are never ropes
+Object* makeConcatenation(Object* a, Object* b){
+	if (stringLength(a) == 0) return b;
+	if (stringLength(b) == 0) return a;
+
+	int length = stringLength(a) + stringLength(b);
+	if (length < ROPE_MIN_LENGTH){
+		ObjectString* left = (ObjectString*) a;
+		ObjectString* right = (ObjectString*) b;
+		char string[ROPE_MIN_LENGTH];
+		memcpy(string, left->string, left->length);
+		memcpy(string + left->length, right->string, right->length);
+		return (Object*) makeStringObject(string, length);
+	}
+
+	// Flattened ropes are replaced by their string, so that their children can be freed
+	if (a->objectType == OBJECT_ROPE && ((ObjectRope*) a)->flat != NULL) a = (Object*) ((ObjectRope*) a)->flat;
+	if (b->objectType == OBJECT_ROPE && ((ObjectRope*) b)->flat != NULL) b = (Object*) ((ObjectRope*) b)->flat;
 
-	size_t i = 0;
-	uint32_t hash = 0;
-	while (i != length) {
-	  hash += key[i++];
-	  hash += hash << 10;
-	  hash ^= hash >> 6;
+	ObjectRope* rope = (ObjectRope*) allocateObject(sizeof(ObjectRope), OBJECT_ROPE);
+	rope->length = length;
+	rope->left = a;
+	rope->right = b;
+	rope->flat = NULL;
+	return (Object*) rope;
+}
+
+// Copies the characters of the rope into an interned string, which then replaces its children
+// Ropes get flattened where they are only referenced from C locals (comparisons, print), so no gc runs meanwhile
+ObjectString* flattenRope(ObjectRope* rope){
+	if (rope->flat != NULL) return rope->flat;
+	vm.gc.isDeferred = true;
+
+	// The characters have to be copied before they can be looked up, so the string is allocated first
+	// and left for the gc if it turns out to be interned already
+	int length = rope->length;
+	ObjectString* flat = allocateStringObject(length);
+	char* string = flat->string;
+
+	// Pieces are copied from the last one: ropes built by appending lean to the left, so the pieces left to copy stay few
+	Object* inlinePieces[64];
+	Object** pieces = inlinePieces;
+	int capacity = 64;
+	int count = 0;
+	pieces[count++] = (Object*) rope;
+	int end = length;
+	while (count > 0){
+		Object* piece = pieces[--count];
+		if (piece->objectType == OBJECT_ROPE && ((ObjectRope*) piece)->flat != NULL) piece = (Object*) ((ObjectRope*) piece)->flat;
+
+		if (piece->objectType == OBJECT_STRING){
+			ObjectString* pieceString = (ObjectString*) piece;
+			end -= pieceString->length;
+			memcpy(string + end, pieceString->string, pieceString->length);
+			continue;
+		}
+
+		if (count + 2 > capacity){
+			capacity *= 2;
+			Object** grown = (Object**) malloc(sizeof(Object*) * capacity);
+			if (grown == NULL) exit(1);
+			memcpy(grown, pieces, sizeof(Object*) * count);
+			if (pieces != inlinePieces) free(pieces);
+			pieces = grown;
+		}
+		pieces[count++] = ((ObjectRope*) piece)->left;
+		pieces[count++] = ((ObjectRope*) piece)->right;
 	}
-	hash += hash << 3;
-	hash ^= hash >> 11;
-	hash += hash << 15;
+	if (pieces != inlinePieces) free(pieces);
+
+	// Interned like makeStringObject does, without pushing on the stack: the vm may not have saved its stack pointer
+	flat->hash = hashString(string, length);
+	ObjectString* interned = tableFindString(&vm.strings, string, length, flat->hash);
+	if (interned != NULL) flat = interned;
+	else tableAdd(&vm.strings, flat, NIL);
+
+	rope->flat = flat;
+	rope->left = NULL;
+	rope->right = NULL;
+	WRITE_BARRIER(rope, OBJECT(flat));
 
-	return hash;
+	vm.gc.isDeferred = false;
+	return flat;
+}
+
+// Multiplies the two words into 128 bits and folds the halves together, so that every bit of both words reaches every bit of the result
+static inline uint64_t mixWords(uint64_t a, uint64_t b){
+	#ifdef __SIZEOF_INT128__
+	__uint128_t product = (__uint128_t) a * b;
+	return (uint64_t) product ^ (uint64_t) (product >> 64);
+	#else
+	// Without 128-bit integers, the high half of the product is made from the four 32-bit partial products
+	uint64_t aLow = (uint32_t) a, aHigh = a >> 32, bLow = (uint32_t) b, bHigh = b >> 32;
+	uint64_t low = aLow * bLow, middle1 = aHigh * bLow, middle2 = aLow * bHigh, high = aHigh * bHigh;
+	uint64_t carry = ((low >> 32) + (uint32_t) middle1 + (uint32_t) middle2) >> 32;
+	return (a * b) ^ (high + (middle1 >> 32) + (middle2 >> 32) + carry);
+	#endif
+}
+
+static inline uint64_t readWord(const char* bytes){
+	uint64_t word;
+	memcpy(&word, bytes, sizeof(word));
+	return word;
+}
+
+// Hashes 16 bytes per step in the style of wyhash, identifiers mostly take a single step
+uint32_t hashString(const char* key, int length){
+	const uint64_t secret0 = 0xa0761d6478bd642full, secret1 = 0xe7037ed1a0b428dbull, secret2 = 0x8ebc6af09c88c6e3ull;
+
+	uint64_t hash = secret0 ^ (uint64_t) length;
+	for (; length > 16; key += 16, length -= 16){
+		hash = mixWords(readWord(key) ^ secret1, readWord(key + 8) ^ hash);
+	}
+
+	// The last 1 to 16 bytes, read as two words that overlap when there are fewer than 16
+	uint64_t a = 0, b = 0;
+	if (length >= 8){
+		a = readWord(key);
+		b = readWord(key + length - 8);
+	} else if (length > 0){
+		memcpy(&a, key, length);
+	}
+	hash = mixWords(a ^ secret1, b ^ hash);
+	return (uint32_t) mixWords(hash ^ secret2, (uint64_t) length ^ secret1);
 }
@@ -3,14 +3,16 @@
 
 #include "../common.h"
 
-// ObjectUpvalue defined in "value.h" because of circular dependency problems
+// ObjectUpvalue and ObjectInstance defined in "value.h" because of circular dependency problems
 
 struct Table;
+struct Shape;
 
 // Rely on forward declaration for Chunk
 // since "chunk.h" uses "object.h", so cannot include "chunk.h"
 typedef struct Chunk Chunk;
 typedef struct ObjectUpvalue ObjectUpvalue;
+typedef struct ObjectInstance ObjectInstance;
 
 typedef enum{
 	OBJECT_STRING,
@@ -20,9 +22,12 @@ typedef enum{
 	OBJECT_UPVALUE,
 	OBJECT_CLASS,
 	OBJECT_INSTANCE,
-	OBJECT_BOUND_METHOD
+	OBJECT_BOUND_METHOD,
+	OBJECT_ROPE
 } ObjectType;
 
+#define OBJECT_TYPE_COUNT (OBJECT_ROPE + 1)
+
 typedef enum{
 	FUNCTION_MAIN,
 	FUNCTION,
@@ -30,19 +35,45 @@ typedef enum{
 	METHOD_INIT
 } FunctionType;
 
+// The header fits in a single word: mark bits are kept in side bitmaps, and the heap is walked page by page instead of through a list
 typedef struct Object{
-	ObjectType objectType;	
-	struct Object* next;
-	bool isMarked;
+	// ObjectType, in a byte
+	uint8_t objectType;
+	// Set while the object is in the remembered set of the generational gc
+	bool isRemembered;
+	// Set once a minor gc copied a young object to the old generation, the address of the copy then follows the header
+	bool isForwarded;
+	// Old object too big for the slab, malloc'd behind a LargeObject header (see "slab.h")
+	bool isLarge;
 } Object;
 
+// Where a moved object was copied to, written over the first word after its header (every object is at least 16 bytes)
+#define FORWARDING_ADDRESS(object) (((Object**) (object))[1])
+
 typedef struct{
 	Object object;
-	int length;
-	char* string;
+	// Right after the header, where the forwarding pointer of a promoted string leaves it readable (see sweepNursery)
 	uint32_t hash;
+	int length;
+	// Index into class vtables if this string is a method name, -1 otherwise
+	int selector;
+	// Null terminated, allocated with the string
+	char string[];
 } ObjectString;
 
+// Concatenation of two strings or ropes that has not been copied yet, made by `+` when the result is ROPE_MIN_LENGTH characters or longer
+// Building a string piece by piece then costs a node per piece instead of a copy of the whole string each time
+// The characters are only copied, hashed and interned once something needs them (see flattenRope)
+typedef struct{
+	Object object;
+	int length;
+	// NULL once flattened
+	Object* left;
+	Object* right;
+	// Interned string with the characters of the rope once flattened, NULL before
+	ObjectString* flat;
+} ObjectRope;
+
 typedef struct{
 	Object object;
 	int arity;
@@ -71,16 +102,25 @@ typedef struct{
 typedef struct ObjectClass{
 	Object object;
 	ObjectString* name;
-	struct Table* methods;
+	// Methods indexed by the selector of their name, NULL where the class has no such method
+	ObjectClosure** vtable;
+	int vtableSize;
+	// `init` method, NULL if the class has none
+	ObjectClosure* initializer;
 	struct ObjectClass* superclass;
+	// Bumped whenever the methods change, so that inline caches holding an older version are ignored
+	uint32_t version;
+	// Set once an instance gets a field with the same name as one of the methods
+	// Methods are then no longer cached since instances of the class can resolve a name differently
+	bool fieldShadowsMethod;
+
+	// Root of the shape transition tree shared by the instances of this class
+	struct Shape* rootShape;
+	int shapeCount;
+	// Most fields any shape of the class has, used to size the inline fields of new instances
+	int instanceSize;
 } ObjectClass;
 
-typedef struct{
-	Object object;
-	ObjectClass* Class;
-	struct Table* fields;
-} ObjectInstance;
-
 typedef struct{
 	Object object;
 	ObjectClosure* closure;
@@ -88,7 +128,6 @@ typedef struct{
 } ObjectBoundMethod;
 
 ObjectString* makeStringObject(const char*,int);
-ObjectString* allocateStringObject(char*, int);
 ObjectFunction* makeNewFunctionObject(FunctionType);
 ObjectClosure* makeNewFunctionClosureObject(ObjectFunction*);
 ObjectNativeFunction* makeNewNativeFunctionObject(ObjectString*, int, NativeFunction);
@@ -96,8 +135,29 @@ ObjectUpvalue* makeNewUpvalueObject(int);
 ObjectClass* makeClassObject(ObjectString*);
 ObjectInstance* makeInstanceObject(ObjectClass*);
 ObjectBoundMethod* makeBoundMethodObject(ObjectClosure*, ObjectInstance*);
+Object* makeConcatenation(Object*, Object*);
+ObjectString* flattenRope(ObjectRope*);
+
+void setMethod(ObjectClass*, ObjectString*, ObjectClosure*);
+void inheritMethods(ObjectClass*, ObjectClass*);
 
 Object* allocateObject(int,ObjectType);
-uint32_t jenkinsHash(const char*,int);
+const char* objectTypeName(ObjectType);
+uint32_t hashString(const char*,int);
+
+// Method lookup is a vtable index
+static inline ObjectClosure* findMethod(ObjectClass* class, ObjectString* name){
+	if (name->selector < 0 || name->selector >= class->vtableSize) return NULL;
+	return class->vtable[name->selector];
+}
+
+// Characters of a string or a rope, flattening the rope if it was not yet
+static inline ObjectString* flattenString(Object* string){
+	return string->objectType == OBJECT_ROPE ? flattenRope((ObjectRope*) string) : (ObjectString*) string;
+}
+
+static inline int stringLength(Object* string){
+	return string->objectType == OBJECT_ROPE ? ((ObjectRope*) string)->length : ((ObjectString*) string)->length;
+}
 
 #endif
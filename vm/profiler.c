@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profiler.h"
+#include "vm.h"
+
+extern VM vm;
+
+// Allocation sites shown in the report
+#define PROFILE_REPORT_SITES 20
+// Longest call stack recorded, deeper ones keep their innermost frames
+#define PROFILE_STACK_LENGTH 4096
+
+// Bytes and samples recorded for a key: a call stack, or an allocation site
+typedef struct{
+	char* key;
+	uint32_t hash;
+	int64_t bytes;
+	int64_t samples;
+} ProfileEntry;
+
+// Open addressing, with plain malloc: the profiler must not count towards the heap, nor run the gc
+typedef struct{
+	int count;
+	int capacity;
+	ProfileEntry* entries;
+} ProfileTable;
+
+static ProfileTable stacks;
+static ProfileTable sites;
+
+void initProfiler(){
+	vm.profiler.countdown = INT64_MAX;
+	vm.profiler.interval = 0;
+	vm.profiler.samples = 0;
+}
+
+static void freeProfileTable(ProfileTable* table){
+	for (int i=0; i < table->capacity; i++){
+		free(table->entries[i].key);
+	}
+	free(table->entries);
+	*table = (ProfileTable) {0, 0, NULL};
+}
+
+void freeProfiler(){
+	freeProfileTable(&stacks);
+	freeProfileTable(&sites);
+}
+
+// Samples one allocation every `interval` bytes from now on
+void startProfiler(int64_t interval){
+	vm.profiler.interval = interval;
+	vm.profiler.countdown = interval;
+}
+
+static uint32_t hashKey(const char* key){
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (; *key != '\0'; key++){
+		hash ^= (uint8_t) *key;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static ProfileEntry* findProfileEntry(ProfileEntry* entries, int capacity, const char* key, uint32_t hash){
+	int index = hash & (capacity - 1);
+	while (entries[index].key != NULL && (entries[index].hash != hash || strcmp(entries[index].key, key) != 0)){
+		index = (index + 1) & (capacity - 1);
+	}
+	return entries + index;
+}
+
+static void addToProfileTable(ProfileTable* table, const char* key, int64_t bytes, int64_t samples){
+	if ((table->count + 1) * 4 > table->capacity * 3){
+		int capacity = table->capacity < 64 ? 64 : table->capacity * 2;
+		ProfileEntry* entries = (ProfileEntry*) calloc(capacity, sizeof(ProfileEntry));
+		if (entries == NULL) exit(1);
+		for (int i=0; i < table->capacity; i++){
+			ProfileEntry* entry = table->entries + i;
+			if (entry->key != NULL) *findProfileEntry(entries, capacity, entry->key, entry->hash) = *entry;
+		}
+		free(table->entries);
+		table->entries = entries;
+		table->capacity = capacity;
+	}
+
+	uint32_t hash = hashKey(key);
+	ProfileEntry* entry = findProfileEntry(table->entries, table->capacity, key, hash);
+	if (entry->key == NULL){
+		entry->key = strdup(key);
+		if (entry->key == NULL) exit(1);
+		entry->hash = hash;
+		table->count++;
+	}
+	entry->bytes += bytes;
+	entry->samples += samples;
+}
+
+// `function:line` of the call frame, the line of the instruction it is executing (or returning to)
+static int writeFrame(char* buffer, int size, CallFrame* frame){
+	ObjectFunction* function = frame->closure->function;
+	int index = (int) (frame->ip - function->chunk->code) - 1;
+	if (index < 0) index = 0;
+	return snprintf(buffer, size, "%s:%d", function->name == NULL ? "script" : function->name->string, function->chunk->lines[index]);
+}
+
+static const char* sampleTypeName(int type){
+	return type == PROFILE_DATA ? "data" : objectTypeName((ObjectType) type);
+}
+
+// Called by SAMPLE_ALLOCATION once the countdown ran out: the allocation stands for every `interval` bytes it took the countdown past 0,
+// which keeps the bytes recorded close to the bytes allocated however big the allocations are
+void sampleAllocation(int type){
+	int64_t samples = 1 + (-vm.profiler.countdown) / vm.profiler.interval;
+	vm.profiler.countdown += samples * vm.profiler.interval;
+	vm.profiler.samples += samples;
+	int64_t bytes = samples * vm.profiler.interval;
+
+	// Outermost frame first, the way flamegraphs expect them, and the type of the allocation as the innermost one
+	// The frame pointers are those the vm last saved, allocations always save them first (see runVM)
+	char stack[PROFILE_STACK_LENGTH];
+	int length = 0;
+	int firstFrame = 0;
+	// Each frame takes less than 128 characters unless its function has a very long name
+	if (vm.frameCount > PROFILE_STACK_LENGTH / 128) firstFrame = vm.frameCount - PROFILE_STACK_LENGTH / 128;
+	if (vm.frameCount == 0) length += snprintf(stack, sizeof(stack), "compiler;");
+	for (int i=firstFrame; i < vm.frameCount && length < PROFILE_STACK_LENGTH; i++){
+		length += writeFrame(stack + length, PROFILE_STACK_LENGTH - length, vm.frames + i);
+		if (length < PROFILE_STACK_LENGTH) length += snprintf(stack + length, PROFILE_STACK_LENGTH - length, ";");
+	}
+	if (length < PROFILE_STACK_LENGTH) snprintf(stack + length, PROFILE_STACK_LENGTH - length, "%s", sampleTypeName(type));
+	addToProfileTable(&stacks, stack, bytes, samples);
+
+	char site[256];
+	if (vm.frameCount == 0) snprintf(site, sizeof(site), "compiler %s", sampleTypeName(type));
+	else{
+		int siteLength = writeFrame(site, sizeof(site), vm.frames + vm.frameCount - 1);
+		if (siteLength < (int) sizeof(site)) snprintf(site + siteLength, sizeof(site) - siteLength, " %s", sampleTypeName(type));
+	}
+	addToProfileTable(&sites, site, bytes, samples);
+}
+
+static int compareBytes(const void* a, const void* b){
+	int64_t bytesA = (*(ProfileEntry* const*) a)->bytes, bytesB = (*(ProfileEntry* const*) b)->bytes;
+	return (bytesA < bytesB) - (bytesA > bytesB);
+}
+
+// Prints the allocation sites that allocated the most on stderr, and writes every sampled call stack to `path`
+// in the collapsed format of flamegraph.pl (`frame;frame;...;type bytes` lines). Returns false if the file could not be written
+bool writeAllocationProfile(const char* path){
+	int64_t total = vm.profiler.samples * vm.profiler.interval;
+	fprintf(stderr, "allocation profile: %lld bytes in %lld samples, one every %lld bytes\n",
+			(long long) total, (long long) vm.profiler.samples, (long long) vm.profiler.interval);
+
+	ProfileEntry** ranked = (ProfileEntry**) malloc(sizeof(ProfileEntry*) * (sites.count + 1));
+	if (ranked == NULL) exit(1);
+	int count = 0;
+	for (int i=0; i < sites.capacity; i++){
+		if (sites.entries[i].key != NULL) ranked[count++] = sites.entries + i;
+	}
+	qsort(ranked, count, sizeof(ProfileEntry*), compareBytes);
+
+	fprintf(stderr, "%14s %7s %10s  %s\n", "bytes", "", "samples", "site");
+	for (int i=0; i < count && i < PROFILE_REPORT_SITES; i++){
+		fprintf(stderr, "%14lld %6.1f%% %10lld  %s\n", (long long) ranked[i]->bytes, 100.0 * ranked[i]->bytes / total,
+				(long long) ranked[i]->samples, ranked[i]->key);
+	}
+	free(ranked);
+
+	FILE* file = fopen(path, "w");
+	if (file == NULL) return false;
+	for (int i=0; i < stacks.capacity; i++){
+		if (stacks.entries[i].key != NULL) fprintf(file, "%s %lld\n", stacks.entries[i].key, (long long) stacks.entries[i].bytes);
+	}
+	bool isWritten = !ferror(file);
+	return fclose(file) == 0 && isWritten;
+}
@@ -0,0 +1,31 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "../common.h"
+#include "object.h"
+
+// Sampling allocation profiler: every `interval` bytes allocated, the call stack of the allocation is recorded
+// with the type of the object (or PROFILE_DATA for what objects own outside of themselves, like character arrays)
+// Switched off, the countdown never reaches 0 and an allocation only pays for a subtraction and a branch
+typedef struct{
+	// Bytes left to allocate before the next sample
+	int64_t countdown;
+	int64_t interval;
+	int64_t samples;
+} AllocationProfiler;
+
+#define PROFILE_DATA OBJECT_TYPE_COUNT
+
+#define SAMPLE_ALLOCATION(size, type) \
+		do { \
+			if ((vm.profiler.countdown -= (int64_t) (size)) <= 0) sampleAllocation(type); \
+		} while (false)
+
+// function prototypes
+void initProfiler();
+void freeProfiler();
+void startProfiler(int64_t interval);
+void sampleAllocation(int type);
+bool writeAllocationProfile(const char* path);
+
+#endif
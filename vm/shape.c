@@ -0,0 +1,141 @@
+#include "shape.h"
+#include "memory.h"
+#include "vm.h"
+
+extern VM vm;
+
+Shape dictionaryShape = {.Class = NULL, .parent = NULL, .key = NULL, .slot = -1, .fieldCount = 0, .firstChild = NULL, .nextSibling = NULL};
+
+Shape* makeRootShape(){
+	Shape* shape = (Shape*) reallocate(NULL, 0, sizeof(Shape));
+	shape->Class = NULL;
+	shape->parent = NULL;
+	shape->key = NULL;
+	shape->slot = -1;
+	shape->fieldCount = 0;
+	shape->firstChild = NULL;
+	shape->nextSibling = NULL;
+	return shape;
+}
+
+void freeShapeTree(Shape* shape){
+	Shape* child = shape->firstChild;
+	while (child != NULL){
+		Shape* next = child->nextSibling;
+		freeShapeTree(child);
+		child = next;
+	}
+	reallocate(shape, sizeof(Shape), 0);
+}
+
+// Points every shape of the tree back to the class that owns it, after the class moved
+void setShapeTreeClass(Shape* shape, ObjectClass* class){
+	shape->Class = class;
+	for (Shape* child = shape->firstChild; child != NULL; child = child->nextSibling){
+		setShapeTreeClass(child, class);
+	}
+}
+
+// Returns the shape with `key` added after the fields of `shape`, creating the transition the first time it is taken
+// Returns NULL if the instance should switch to dictionary mode instead
+Shape* shapeTransition(Shape* shape, ObjectString* key){
+	for (Shape* child = shape->firstChild; child != NULL; child = child->nextSibling){
+		if (child->key == key) return child;
+	}
+
+	ObjectClass* class = shape->Class;
+	if (shape->fieldCount == MAX_SHAPE_FIELDS || class->shapeCount == MAX_CLASS_SHAPES) return NULL;
+
+	Shape* child = makeRootShape();
+	child->Class = class;
+	child->parent = shape;
+	child->key = key;
+	child->slot = shape->fieldCount;
+	child->fieldCount = shape->fieldCount + 1;
+
+	child->nextSibling = shape->firstChild;
+	shape->firstChild = child;
+	class->shapeCount++;
+	WRITE_BARRIER(class, OBJECT(key));
+
+	// New instances of the class reserve inline space for the largest layout seen so far
+	if (child->fieldCount > class->instanceSize) class->instanceSize = child->fieldCount;
+	return child;
+}
+
+// Returns the slot `key` is stored in for instances of this shape, or -1 if there is no such field
+int shapeFindSlot(Shape* shape, ObjectString* key){
+	for (; shape->key != NULL; shape = shape->parent){
+		if (shape->key == key) return shape->slot;
+	}
+	return -1;
+}
+
+bool getInstanceField(ObjectInstance* instance, ObjectString* key, Value* value){
+	if (IS_DICTIONARY_MODE(instance)){
+		if (!tableHas(instance->dictionary, key)) return false;
+		*value = tableGet(instance->dictionary, key);
+		return true;
+	}
+
+	int slot = shapeFindSlot(instance->shape, key);
+	if (slot == -1) return false;
+	*value = instance->fields[slot];
+	return true;
+}
+
+bool instanceHasField(ObjectInstance* instance, ObjectString* key){
+	if (IS_DICTIONARY_MODE(instance)) return tableHas(instance->dictionary, key);
+	return shapeFindSlot(instance->shape, key) != -1;
+}
+
+// Moves every field into a hash table, for instances with too many fields (or too many different layouts) to share shapes
+static void switchToDictionaryMode(ObjectInstance* instance){
+	// The instance is left untouched until the table is complete since the gc can run while filling it
+	Table* dictionary = reallocate(NULL, 0, sizeof(Table));
+	initTable(dictionary);
+	for (Shape* shape = instance->shape; shape->key != NULL; shape = shape->parent){
+		tableAdd(dictionary, shape->key, instance->fields[shape->slot]);
+	}
+
+	if (instance->fields != instance->inlineFields) FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+	instance->fields = NULL;
+	instance->fieldCapacity = 0;
+	instance->dictionary = dictionary;
+	instance->shape = &dictionaryShape;
+}
+
+void setInstanceField(ObjectInstance* instance, ObjectString* key, Value value){
+	// Covers the fields and the dictionary (the one table owned by a heap object)
+	WRITE_BARRIER(instance, value);
+
+	if (!IS_DICTIONARY_MODE(instance)){
+		int slot = shapeFindSlot(instance->shape, key);
+		if (slot != -1){
+			instance->fields[slot] = value;
+			return;
+		}
+
+		Shape* shape = shapeTransition(instance->shape, key);
+		if (shape != NULL){
+			if (shape->slot == instance->fieldCapacity){
+				// Outgrew the inline slots, move the fields to a bigger heap array
+				int capacity = GROW_CAPACITY(instance->fieldCapacity);
+				Value* fields = (Value*) reallocate(NULL, 0, sizeof(Value) * capacity);
+				memcpy(fields, instance->fields, sizeof(Value) * instance->fieldCapacity);
+
+				if (instance->fields != instance->inlineFields) FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+				instance->fields = fields;
+				instance->fieldCapacity = capacity;
+			}
+
+			instance->fields[shape->slot] = value;
+			instance->shape = shape;
+			return;
+		}
+
+		switchToDictionaryMode(instance);
+	}
+
+	tableAdd(instance->dictionary, key, value);
+}
@@ -0,0 +1,43 @@
+#ifndef SHAPE_H
+#define SHAPE_H
+
+#include "../common.h"
+#include "value.h"
+#include "table.h"
+
+// Instances with more fields than this, or whose class already has this many shapes, switch to dictionary mode
+#define MAX_SHAPE_FIELDS 64
+#define MAX_CLASS_SHAPES 256
+
+// A shape (hidden class) describes the layout of an instance's fields: which field lives in which slot of `instance->fields`
+// Shapes form a transition tree owned by the class: the root shape has no fields,
+// and every child adds one field (`key`) in the next free slot, so instances that add the same fields in the same order share a shape
+typedef struct Shape{
+	ObjectClass* Class;
+	struct Shape* parent;
+	ObjectString* key;
+	int slot;
+	int fieldCount;
+
+	// transitions to the shapes that add one more field to this one
+	struct Shape* firstChild;
+	struct Shape* nextSibling;
+} Shape;
+
+// Shared by every instance in dictionary mode, which keeps its fields in `instance->dictionary` instead
+extern Shape dictionaryShape;
+
+#define IS_DICTIONARY_MODE(instance) ((instance)->shape == &dictionaryShape)
+
+// function prototypes
+Shape* makeRootShape();
+void freeShapeTree(Shape*);
+void setShapeTreeClass(Shape*, ObjectClass*);
+Shape* shapeTransition(Shape*, ObjectString*);
+int shapeFindSlot(Shape*, ObjectString*);
+
+bool getInstanceField(ObjectInstance*, ObjectString*, Value*);
+bool instanceHasField(ObjectInstance*, ObjectString*);
+void setInstanceField(ObjectInstance*, ObjectString*, Value);
+
+#endif
@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+#include "memory.h"
+#include "vm.h"
+
+extern VM vm;
+
+// Slots start after the page header, on a 16 byte boundary
+#define SLOTS_OFFSET ((sizeof(SlabPage) + 15) & ~(size_t) 15)
+
+static int pageCapacity(int sizeClass){
+	int capacity = (SLAB_PAGE_SIZE - SLOTS_OFFSET) / ((sizeClass + 1) * 8);
+	return capacity < SLAB_MAX_SLOTS ? capacity : SLAB_MAX_SLOTS;
+}
+
+// Pages are mapped straight from the system, so that the ones the gc empties really go back to it
+// mmap only aligns on the system page size: twice the size is mapped, and what is around the aligned page unmapped
+static SlabPage* mapSlabPage(){
+	uint8_t* memory = (uint8_t*) mmap(NULL, 2 * SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) exit(1);
+
+	uint8_t* page = (uint8_t*) (((uintptr_t) memory + SLAB_PAGE_SIZE - 1) & ~((uintptr_t) SLAB_PAGE_SIZE - 1));
+	if (page > memory) munmap(memory, page - memory);
+	munmap(page + SLAB_PAGE_SIZE, memory + SLAB_PAGE_SIZE - page);
+	return (SlabPage*) page;
+}
+
+static void unmapSlabPage(SlabPage* page){
+	munmap(page, SLAB_PAGE_SIZE);
+}
+
+void initSlab(){
+	for (int i=0; i < SLAB_SIZE_CLASSES; i++){
+		SizeClass* class = vm.slab.classes + i;
+		class->pages = NULL;
+		class->unswept = NULL;
+		class->evacuated = NULL;
+		class->freeList = NULL;
+		class->pageCount = 0;
+		class->slotCount = 0;
+		class->usedSlots = 0;
+		class->usedBytes = 0;
+	}
+
+	vm.slab.largeObjects = NULL;
+	vm.slab.unsweptLargeObjects = NULL;
+	vm.slab.largeObjectCount = 0;
+	vm.slab.largeObjectBytes = 0;
+}
+
+static void freePages(SlabPage* page){
+	while (page != NULL){
+		SlabPage* next = page->next;
+		for (int slot=0; slot < page->capacity; slot++){
+			if (IS_SLOT_ALLOCATED(page, slot)) freeObjectContents(SLOT_OBJECT(page, slot));
+		}
+		unmapSlabPage(page);
+		page = next;
+	}
+}
+
+static void freeLargeObjects(LargeObject* header){
+	while (header != NULL){
+		LargeObject* next = header->next;
+		freeObjectContents(LARGE_OBJECT(header));
+		free(header);
+		header = next;
+	}
+}
+
+// Frees every page and large object, along with what the objects own
+void freeSlab(){
+	for (int i=0; i < SLAB_SIZE_CLASSES; i++){
+		freePages(vm.slab.classes[i].pages);
+		freePages(vm.slab.classes[i].unswept);
+	}
+	freeLargeObjects(vm.slab.largeObjects);
+	freeLargeObjects(vm.slab.unsweptLargeObjects);
+	initSlab();
+}
+
+// Gets a new page for the size class and puts all of its slots on the free list, in address order
+static void addSlabPage(SizeClass* class, int sizeClass){
+	SlabPage* page = mapSlabPage();
+
+	page->sizeClass = sizeClass;
+	page->slotSize = (sizeClass + 1) * 8;
+	page->slots = (uint8_t*) page + SLOTS_OFFSET;
+	page->capacity = pageCapacity(sizeClass);
+	page->usedSlots = 0;
+	page->isUnswept = false;
+	memset(page->allocated, 0, sizeof(page->allocated));
+	memset(page->marks, 0, sizeof(page->marks));
+
+	FreeSlot* freeList = class->freeList;
+	for (int slot=page->capacity - 1; slot >= 0; slot--){
+		FreeSlot* free = (FreeSlot*) SLOT_OBJECT(page, slot);
+		free->next = freeList;
+		freeList = free;
+	}
+	class->freeList = freeList;
+
+	page->next = class->pages;
+	class->pages = page;
+	class->pageCount++;
+	class->slotCount += page->capacity;
+}
+
+// Frees the unmarked objects of the first unswept page of the size class, then clears its mark bits
+// Live objects are not even read, only the bitmaps. The free slots go to the free list, unless the page is empty: then it goes back to the system
+static void sweepSlabPage(SizeClass* class){
+	SlabPage* page = class->unswept;
+	class->unswept = page->next;
+	page->isUnswept = false;
+
+	FreeSlot* freeList = NULL;
+	FreeSlot** last = &freeList;
+	for (int slot=0; slot < page->capacity; slot++){
+		Object* object = SLOT_OBJECT(page, slot);
+
+		if (IS_SLOT_ALLOCATED(page, slot)){
+			size_t mark = MARK_INDEX(page, object);
+			if ((page->marks[mark / 64] >> (mark % 64)) & 1) continue;
+
+			#ifdef DEBUG_LOG_GC
+			printf("free object of type: %d\t", object->objectType);
+			printValue(OBJECT(object));
+			printf("\n");
+			#endif
+
+			int size = objectSize(object);
+			int64_t bytesBefore = vm.bytesAllocated;
+			freeObjectContents(object);
+			vm.gc.stats.freedObjects[object->objectType]++;
+			vm.bytesAllocated -= size;
+			vm.gc.stats.current.bytesFreed += bytesBefore - vm.bytesAllocated;
+			class->usedBytes -= size;
+			class->usedSlots--;
+			page->usedSlots--;
+			page->allocated[slot / 64] &= ~((uint64_t) 1 << (slot % 64));
+		}
+
+		*last = (FreeSlot*) object;
+		last = &(*last)->next;
+	}
+	*last = NULL;
+	memset(page->marks, 0, sizeof(page->marks));
+
+	if (page->usedSlots == 0){
+		class->pageCount--;
+		class->slotCount -= page->capacity;
+		unmapSlabPage(page);
+		return;
+	}
+
+	*last = class->freeList;
+	class->freeList = freeList;
+	page->next = class->pages;
+	class->pages = page;
+}
+
+void* slabAllocate(int size){
+	int sizeClass = SLAB_SIZE_CLASS(size);
+	SizeClass* class = vm.slab.classes + sizeClass;
+
+	// Pages the gc has not swept yet are swept on demand, before taking a new one
+	// A few at most: after a cycle that freed little, a minor gc promoting into full pages would otherwise sweep the whole size class
+	for (int swept=0; class->freeList == NULL && class->unswept != NULL && swept < SLAB_SWEEP_ON_DEMAND; swept++) sweepSlabPage(class);
+	if (class->freeList == NULL) addSlabPage(class, sizeClass);
+
+	FreeSlot* free = class->freeList;
+	class->freeList = free->next;
+
+	SlabPage* page = SLAB_PAGE_OF(free);
+	int slot = ((uint8_t*) free - page->slots) / page->slotSize;
+	page->allocated[slot / 64] |= (uint64_t) 1 << (slot % 64);
+	page->usedSlots++;
+	class->usedSlots++;
+	class->usedBytes += size;
+	return free;
+}
+
+// Called once marking is over: every page has to be swept before its free slots can be used again
+// since objects allocated in them would not be marked
+void startSlabSweep(){
+	for (int i=0; i < SLAB_SIZE_CLASSES; i++){
+		SizeClass* class = vm.slab.classes + i;
+		for (SlabPage* page = class->pages; page != NULL; page = page->next){
+			page->isUnswept = true;
+		}
+		class->unswept = class->pages;
+		class->pages = NULL;
+		class->freeList = NULL;
+	}
+
+	vm.slab.unsweptLargeObjects = vm.slab.largeObjects;
+	vm.slab.largeObjects = NULL;
+}
+
+// Sweeps pages until `budget` slots were swept, returns whether every page was swept
+bool sweepSlabPages(int* budget){
+	for (int i=0; i < SLAB_SIZE_CLASSES; i++){
+		SizeClass* class = vm.slab.classes + i;
+		while (class->unswept != NULL){
+			if (*budget <= 0) return false;
+			*budget -= class->unswept->capacity;
+			sweepSlabPage(class);
+		}
+	}
+	return true;
+}
+
+// Large objects count towards `vm.bytesAllocated` with their header
+void* allocateLargeObject(int size){
+	LargeObject* header = (LargeObject*) reallocateUnsampled(NULL, 0, sizeof(LargeObject) + size);
+	header->marks = 0;
+	header->next = vm.slab.largeObjects;
+	vm.slab.largeObjects = header;
+	vm.slab.largeObjectCount++;
+	vm.slab.largeObjectBytes += size;
+	return LARGE_OBJECT(header);
+}
+
+// Frees the unmarked large objects and moves the marked ones back to the live list, until `budget` objects were swept
+// Returns whether every large object was swept
+bool sweepLargeObjects(int* budget){
+	while (vm.slab.unsweptLargeObjects != NULL){
+		if (*budget <= 0) return false;
+		(*budget)--;
+
+		LargeObject* header = vm.slab.unsweptLargeObjects;
+		vm.slab.unsweptLargeObjects = header->next;
+
+		if (header->marks != 0){
+			header->marks = 0;
+			header->next = vm.slab.largeObjects;
+			vm.slab.largeObjects = header;
+			continue;
+		}
+
+		Object* object = LARGE_OBJECT(header);
+		#ifdef DEBUG_LOG_GC
+		printf("free object of type: %d\t", object->objectType);
+		printValue(OBJECT(object));
+		printf("\n");
+		#endif
+
+		int size = objectSize(object);
+		int64_t bytesBefore = vm.bytesAllocated;
+		freeObjectContents(object);
+		vm.gc.stats.freedObjects[object->objectType]++;
+		vm.slab.largeObjectCount--;
+		vm.slab.largeObjectBytes -= size;
+		reallocate(header, sizeof(LargeObject) + size, 0);
+		vm.gc.stats.current.bytesFreed += bytesBefore - vm.bytesAllocated;
+	}
+	return true;
+}
+
+// Compaction: objects of the sparsest pages of every size class are moved to the free slots of the densest ones
+// Only called once a gc cycle is over, so every page was swept and every allocated slot holds an object the gc kept
+
+static int compareUsedSlots(const void* a, const void* b){
+	return (*(SlabPage**) b)->usedSlots - (*(SlabPage**) a)->usedSlots;
+}
+
+// Fewest pages the objects of the size class fit in
+static int neededPages(SizeClass* class, int sizeClass){
+	int capacity = pageCapacity(sizeClass);
+	return (class->usedSlots + capacity - 1) / capacity;
+}
+
+// Pages a compaction would give back to the system
+int reclaimableSlabPages(){
+	int pages = 0;
+	for (int i=0; i < SLAB_SIZE_CLASSES; i++){
+		SizeClass* class = vm.slab.classes + i;
+		if (class->unswept == NULL) pages += class->pageCount - neededPages(class, i);
+	}
+	return pages;
+}
+
+// Frees the slots of the pages in a single free list, in address order
+static FreeSlot* collectFreeSlots(SlabPage** pages, int count){
+	FreeSlot* freeList = NULL;
+	FreeSlot** last = &freeList;
+	for (int i=0; i < count; i++){
+		SlabPage* page = pages[i];
+		for (int slot=0; slot < page->capacity; slot++){
+			if (IS_SLOT_ALLOCATED(page, slot)) continue;
+			*last = (FreeSlot*) SLOT_OBJECT(page, slot);
+			last = &(*last)->next;
+		}
+	}
+	*last = NULL;
+	return freeList;
+}
+
+// Moves every object out of the pages the size class can do without, leaving forwarding pointers behind
+// The emptied pages are kept in `evacuated` until every reference to their objects was updated
+static void evacuateSizeClass(SizeClass* class, int sizeClass){
+	int needed = neededPages(class, sizeClass);
+	if (class->unswept != NULL || needed == class->pageCount) return;
+
+	SlabPage** pages = (SlabPage**) malloc(sizeof(SlabPage*) * class->pageCount);
+	if (pages == NULL) exit(1);
+	int count = 0;
+	for (SlabPage* page = class->pages; page != NULL; page = page->next){
+		pages[count++] = page;
+	}
+	qsort(pages, count, sizeof(SlabPage*), compareUsedSlots);
+
+	// The densest pages are kept
+	class->pages = NULL;
+	for (int i=needed - 1; i >= 0; i--){
+		pages[i]->next = class->pages;
+		class->pages = pages[i];
+	}
+	FreeSlot* freeList = collectFreeSlots(pages, needed);
+
+	for (int i=needed; i < count; i++){
+		SlabPage* page = pages[i];
+		for (int slot=0; slot < page->capacity; slot++){
+			if (!IS_SLOT_ALLOCATED(page, slot)) continue;
+
+			Object* object = SLOT_OBJECT(page, slot);
+			Object* copy = (Object*) freeList;
+			freeList = freeList->next;
+
+			SlabPage* target = SLAB_PAGE_OF(copy);
+			int targetSlot = ((uint8_t*) copy - target->slots) / target->slotSize;
+			target->allocated[targetSlot / 64] |= (uint64_t) 1 << (targetSlot % 64);
+			target->usedSlots++;
+
+			memcpy(copy, object, objectSize(object));
+			relocateObject(object, copy);
+		}
+
+		page->next = class->evacuated;
+		class->evacuated = page;
+		class->pageCount--;
+		class->slotCount -= page->capacity;
+	}
+
+	class->freeList = freeList;
+	free(pages);
+}
+
+void evacuateSparsePages(){
+	for (int i=0; i < SLAB_SIZE_CLASSES; i++){
+		evacuateSizeClass(vm.slab.classes + i, i);
+	}
+}
+
+// Gives the evacuated pages back to the system, returns how many there were
+int releaseEvacuatedPages(){
+	int released = 0;
+	for (int i=0; i < SLAB_SIZE_CLASSES; i++){
+		SizeClass* class = vm.slab.classes + i;
+		while (class->evacuated != NULL){
+			SlabPage* page = class->evacuated;
+			class->evacuated = page->next;
+			unmapSlabPage(page);
+			released++;
+		}
+	}
+	return released;
+}
+
+SlabStats getSlabStats(int sizeClass){
+	SizeClass* class = vm.slab.classes + sizeClass;
+	SlabStats stats;
+	stats.pages = class->pageCount;
+	stats.slots = class->slotCount;
+	stats.usedSlots = class->usedSlots;
+	stats.usedBytes = class->usedBytes;
+	stats.slotBytes = (size_t) class->usedSlots * (sizeClass + 1) * 8;
+	return stats;
+}
+
+// Occupancy is the share of the slots holding an object
+// Internal fragmentation is the share of the used slots the objects do not fill (instances that are smaller than their class)
+// External fragmentation is the share of the pages' bytes in free slots, or lost at the end of the pages
+void printSlabStats(){
+	SlabStats total = {0, 0, 0, 0, 0};
+
+	printf("slab size class   pages   slots    used  occupancy\n");
+	for (int i=0; i < SLAB_SIZE_CLASSES; i++){
+		SlabStats stats = getSlabStats(i);
+		if (stats.pages == 0) continue;
+		printf("slab %10d %7d %7d %7d %9.1f%%\n", (i + 1) * 8, stats.pages, stats.slots, stats.usedSlots, 100.0 * stats.usedSlots / stats.slots);
+
+		total.pages += stats.pages;
+		total.slots += stats.slots;
+		total.usedSlots += stats.usedSlots;
+		total.usedBytes += stats.usedBytes;
+		total.slotBytes += stats.slotBytes;
+	}
+
+	size_t pageBytes = (size_t) total.pages * SLAB_PAGE_SIZE;
+	printf("slab total: %d pages, %.1f%% occupancy, %.1f%% internal fragmentation, %.1f%% external fragmentation\n",
+			total.pages,
+			total.slots == 0 ? 0 : 100.0 * total.usedSlots / total.slots,
+			total.slotBytes == 0 ? 0 : 100.0 * (total.slotBytes - total.usedBytes) / total.slotBytes,
+			pageBytes == 0 ? 0 : 100.0 * (pageBytes - total.slotBytes) / pageBytes);
+	printf("large objects: %d, %zu bytes\n", vm.slab.largeObjectCount, vm.slab.largeObjectBytes);
+}
@@ -0,0 +1,109 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#include "../common.h"
+#include "object.h"
+
+// Old objects up to MAX_SLAB_OBJECT_SIZE bytes live in pages of same sized slots, one size class every 8 bytes
+// so each fixed size object struct gets a class of its own (instances get the class of their inline fields)
+// Bigger objects are malloc'd behind a LargeObject header, which links them together
+#define SLAB_PAGE_SIZE (64 * 1024)
+#define MAX_SLAB_OBJECT_SIZE 256
+#define SLAB_SIZE_CLASSES (MAX_SLAB_OBJECT_SIZE / 8)
+#define SLAB_SIZE_CLASS(size) (((size) + 7) / 8 - 1)
+#define SLAB_MAX_SLOTS (SLAB_PAGE_SIZE / 16)
+// One mark bit per 8 bytes of the page, so the mark bit of an object is found without dividing by its slot size
+#define SLAB_MARK_WORDS (SLAB_PAGE_SIZE / 8 / 64)
+// Most unswept pages an allocation sweeps looking for a free slot before it takes a new page, the slices sweep the others
+#define SLAB_SWEEP_ON_DEMAND 8
+
+// Pages are aligned on their size, so the page of an object is found by masking its address
+#define SLAB_PAGE_OF(pointer) ((SlabPage*) ((uintptr_t) (pointer) & ~((uintptr_t) SLAB_PAGE_SIZE - 1)))
+
+typedef struct FreeSlot{
+	struct FreeSlot* next;
+} FreeSlot;
+
+typedef struct SlabPage{
+	struct SlabPage* next;
+	int sizeClass;
+	int slotSize;
+	int capacity;
+	int usedSlots;
+	// Set until the current gc cycle swept the page, its free slots are only handed out after that
+	bool isUnswept;
+	uint8_t* slots;
+	// One bit per slot holding an object
+	uint64_t allocated[SLAB_MAX_SLOTS / 64];
+	// Mark bits of the objects, cleared when the page is swept
+	uint64_t marks[SLAB_MARK_WORDS];
+} SlabPage;
+
+typedef struct LargeObject{
+	struct LargeObject* next;
+	// Only the first bit is used, a whole word so that it is marked like the slab pages
+	uint64_t marks;
+} LargeObject;
+
+typedef struct{
+	SlabPage* pages;
+	// Pages the current gc cycle has not swept yet
+	SlabPage* unswept;
+	// Pages a compaction moved the objects out of, they still hold the forwarding pointers
+	SlabPage* evacuated;
+	FreeSlot* freeList;
+
+	int pageCount;
+	int slotCount;
+	int usedSlots;
+	size_t usedBytes;
+} SizeClass;
+
+typedef struct{
+	SizeClass classes[SLAB_SIZE_CLASSES];
+
+	LargeObject* largeObjects;
+	// Large objects the current gc cycle has not swept yet
+	LargeObject* unsweptLargeObjects;
+	int largeObjectCount;
+	size_t largeObjectBytes;
+} Slab;
+
+typedef struct{
+	int pages;
+	int slots;
+	int usedSlots;
+	// Bytes of the objects, and of the slots they take up
+	size_t usedBytes;
+	size_t slotBytes;
+} SlabStats;
+
+#define IS_SLAB_OBJECT_SIZE(size) ((size) <= MAX_SLAB_OBJECT_SIZE)
+
+#define IS_SLOT_ALLOCATED(page, slot) (((page)->allocated[(slot) / 64] >> ((slot) % 64)) & 1)
+#define SLOT_OBJECT(page, slot) ((Object*) ((page)->slots + (size_t) (slot) * (page)->slotSize))
+#define MARK_INDEX(page, object) ((size_t) ((uint8_t*) (object) - (page)->slots) / 8)
+
+#define LARGE_OBJECT_HEADER(object) ((LargeObject*) (object) - 1)
+#define LARGE_OBJECT(header) ((Object*) ((header) + 1))
+
+// function prototypes
+void initSlab();
+void freeSlab();
+void* slabAllocate(int size);
+void* allocateLargeObject(int size);
+
+void startSlabSweep();
+bool sweepSlabPages(int* budget);
+bool sweepLargeObjects(int* budget);
+
+int reclaimableSlabPages();
+void evacuateSparsePages();
+int releaseEvacuatedPages();
+
+SlabStats getSlabStats(int sizeClass);
+void printSlabStats();
+
+#endif
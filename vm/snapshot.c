@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+#include "vm.h"
+#include "memory.h"
+#include "shape.h"
+#include "../compiler/compiler.h"
+
+extern VM vm;
+
+// Characters of a string written in its label
+#define STRING_LABEL_LENGTH 40
+
+// The snapshot keeps its own lists with plain malloc: it must not count towards the heap, nor run the gc while it walks it
+typedef struct{
+	Object** objects;
+	int capacity;
+	int count;
+} ObjectList;
+
+static FILE* file;
+// Open addressing set of the objects already reached
+static ObjectList visited;
+// Objects reached but not written yet
+static ObjectList pending;
+// References of the object being written
+static ObjectList references;
+
+static void appendObject(ObjectList* list, Object* object){
+	if (list->count + 1 > list->capacity){
+		list->capacity = GROW_CAPACITY(list->capacity);
+		list->objects = (Object**) realloc(list->objects, sizeof(Object*) * list->capacity);
+		if (list->objects == NULL) exit(1);
+	}
+	list->objects[list->count++] = object;
+}
+
+static int findVisitedSlot(Object** objects, int capacity, Object* object){
+	int index = (int) ((((uintptr_t) object >> 3) * 0x9E3779B97F4A7C15ull) >> 32) & (capacity - 1);
+	while (objects[index] != NULL && objects[index] != object){
+		index = (index + 1) & (capacity - 1);
+	}
+	return index;
+}
+
+// Returns false if the object was already visited
+static bool visitObject(Object* object){
+	if ((visited.count + 1) * 4 > visited.capacity * 3){
+		int capacity = visited.capacity < 1024 ? 1024 : visited.capacity * 2;
+		Object** objects = (Object**) calloc(capacity, sizeof(Object*));
+		if (objects == NULL) exit(1);
+		for (int i=0; i < visited.capacity; i++){
+			if (visited.objects[i] != NULL) objects[findVisitedSlot(objects, capacity, visited.objects[i])] = visited.objects[i];
+		}
+		free(visited.objects);
+		visited.objects = objects;
+		visited.capacity = capacity;
+	}
+
+	int index = findVisitedSlot(visited.objects, visited.capacity, object);
+	if (visited.objects[index] != NULL) return false;
+	visited.objects[index] = object;
+	visited.count++;
+	return true;
+}
+
+static void writeAddress(Object* object){
+	fprintf(file, "0x%llx", (unsigned long long) (uintptr_t) object);
+}
+
+static void addRoot(const char* kind, Object* object){
+	if (object == NULL) return;
+	fprintf(file, "root\t%s\t", kind);
+	writeAddress(object);
+	fprintf(file, "\n");
+	if (visitObject(object)) appendObject(&pending, object);
+}
+
+static void addRootValue(const char* kind, Value value){
+	if (IS_OBJ(value)) addRoot(kind, AS_OBJ(value));
+}
+
+// Same roots as markRoots and markCompilerRoots
+static void addRoots(){
+	addRoot("vm", (Object*) vm.init);
+	for (int i=0; i < vm.selectorNames.count; i++){
+		addRootValue("selector", vm.selectorNames.values[i]);
+	}
+
+	for (int i=0; i < vm.globalSlots.capacity; i++){
+		if (TABLE_KEY(&vm.globalSlots, i) == NULL) continue;
+		addRoot("global", (Object*) TABLE_KEY(&vm.globalSlots, i));
+		addRootValue("global", TABLE_VALUE(&vm.globalSlots, i));
+	}
+	for (int i=0; i < vm.globalValues.count; i++){
+		addRootValue("global", vm.globalValues.values[i]);
+	}
+	for (int i=0; i < vm.globalNames.count; i++){
+		addRootValue("global", vm.globalNames.values[i]);
+	}
+
+	for (Value* slot = vm.stack; slot < vm.stackpointer; slot++){
+		addRootValue("stack", *slot);
+	}
+	for (int i=0; i < vm.frameCount; i++){
+		addRoot("frame", (Object*) vm.frames[i].closure);
+	}
+	for (int i=0; i < STACK_MAX_SIZE; i++){
+		addRoot("upvalue", (Object*) vm.openObjUpvalues[i]);
+	}
+
+	extern Compiler* currentCompiler;
+	for (Compiler* compiler = currentCompiler; compiler != NULL; compiler = compiler->parentCompiler){
+		addRoot("compiler", (Object*) compiler->function);
+	}
+}
+
+static void addReference(Object* object){
+	if (object != NULL) appendObject(&references, object);
+}
+
+static void addReferenceValue(Value value){
+	if (IS_OBJ(value)) addReference(AS_OBJ(value));
+}
+
+static void addShapeTreeReferences(Shape* shape){
+	addReference((Object*) shape->key);
+	for (Shape* child = shape->firstChild; child != NULL; child = child->nextSibling){
+		addShapeTreeReferences(child);
+	}
+}
+
+// Same references as addChildObjectsToGCQueue
+static void collectReferences(Object* object){
+	references.count = 0;
+
+	switch(object->objectType){
+		case OBJECT_NATIVE_FUNCTION:
+			addReference((Object*) ((ObjectNativeFunction*) object)->name);
+			break;
+		case OBJECT_FUNCTION:
+			{
+				ObjectFunction* function = (ObjectFunction*) object;
+				addReference((Object*) function->name);
+				for (int i=0; i < function->chunk->constants.count; i++){
+					addReferenceValue(function->chunk->constants.values[i]);
+				}
+				for (int i=0; i < function->chunk->cacheCount; i++){
+					InlineCache* cache = function->chunk->caches + i;
+					addReference((Object*) cache->Class);
+					addReference((Object*) cache->method);
+					if (cache->shape != NULL) addReference((Object*) cache->shape->Class);
+				}
+			}
+			break;
+		case OBJECT_CLOSURE:
+			{
+				ObjectClosure* closure = (ObjectClosure*) object;
+				addReference((Object*) closure->function);
+				for (int i=0; i < closure->upvaluesCount; i++){
+					addReference((Object*) closure->objUpvalues[i]);
+				}
+			}
+			break;
+		case OBJECT_UPVALUE:
+			addReferenceValue(*((ObjectUpvalue*) object)->value);
+			break;
+		case OBJECT_CLASS:
+			{
+				ObjectClass* class = (ObjectClass*) object;
+				addReference((Object*) class->name);
+				addReference((Object*) class->superclass);
+				for (int i=0; i < class->vtableSize; i++){
+					addReference((Object*) class->vtable[i]);
+				}
+				addShapeTreeReferences(class->rootShape);
+			}
+			break;
+		case OBJECT_INSTANCE:
+			{
+				ObjectInstance* instance = (ObjectInstance*) object;
+				addReference((Object*) instance->Class);
+				if (IS_DICTIONARY_MODE(instance)){
+					for (int i=0; i < instance->dictionary->capacity; i++){
+						if (TABLE_KEY(instance->dictionary, i) == NULL) continue;
+						addReference((Object*) TABLE_KEY(instance->dictionary, i));
+						addReferenceValue(TABLE_VALUE(instance->dictionary, i));
+					}
+				} else{
+					for (int i=0; i < instance->shape->fieldCount; i++){
+						addReferenceValue(instance->fields[i]);
+					}
+				}
+			}
+			break;
+		case OBJECT_BOUND_METHOD:
+			addReference((Object*) ((ObjectBoundMethod*) object)->closure);
+			addReference((Object*) ((ObjectBoundMethod*) object)->instance);
+			break;
+		case OBJECT_ROPE:
+			addReference(((ObjectRope*) object)->left);
+			addReference(((ObjectRope*) object)->right);
+			addReference((Object*) ((ObjectRope*) object)->flat);
+			break;
+		case OBJECT_STRING:
+			break;
+	}
+}
+
+// Size of the object, and of what it owns outside of itself like freeObjectContents frees it
+static size_t snapshotSize(Object* object){
+	size_t size = objectSize(object);
+
+	switch(object->objectType){
+		case OBJECT_FUNCTION:
+			{
+				Chunk* chunk = ((ObjectFunction*) object)->chunk;
+				size += sizeof(Chunk) + (sizeof(uint8_t) + sizeof(int)) * chunk->capacity;
+				size += sizeof(Value) * chunk->constants.capacity + sizeof(InlineCache) * chunk->cacheCapacity;
+			}
+			break;
+		case OBJECT_CLOSURE:
+			size += sizeof(ObjectUpvalue*) * ((ObjectClosure*) object)->upvaluesCount;
+			break;
+		case OBJECT_CLASS:
+			size += sizeof(ObjectClosure*) * ((ObjectClass*) object)->vtableSize;
+			break;
+		case OBJECT_INSTANCE:
+			{
+				ObjectInstance* instance = (ObjectInstance*) object;
+				if (instance->fields != instance->inlineFields) size += sizeof(Value) * instance->fieldCapacity;
+				if (instance->dictionary != NULL) size += sizeof(Table) + TABLE_SLOTS_SIZE(instance->dictionary->capacity);
+			}
+			break;
+		case OBJECT_STRING:
+		case OBJECT_NATIVE_FUNCTION:
+		case OBJECT_UPVALUE:
+		case OBJECT_BOUND_METHOD:
+		case OBJECT_ROPE:
+			break;
+	}
+	return size;
+}
+
+static void writeName(ObjectString* name){
+	fprintf(file, "%s", name == NULL ? "script" : name->string);
+}
+
+// Tabs, line breaks and other control characters are escaped so that the label stays in its column
+static void writeStringLabel(ObjectString* string){
+	int length = string->length < STRING_LABEL_LENGTH ? string->length : STRING_LABEL_LENGTH;
+	for (int i=0; i < length; i++){
+		unsigned char c = (unsigned char) string->string[i];
+		if (c == '\\') fprintf(file, "\\\\");
+		else if (c == '\t') fprintf(file, "\\t");
+		else if (c == '\n') fprintf(file, "\\n");
+		else if (c < 0x20 || c == 0x7f) fprintf(file, "\\x%02x", c);
+		else fputc(c, file);
+	}
+	if (length < string->length) fprintf(file, "...");
+}
+
+static void writeLabel(Object* object){
+	switch(object->objectType){
+		case OBJECT_STRING: writeStringLabel((ObjectString*) object); break;
+		case OBJECT_FUNCTION: writeName(((ObjectFunction*) object)->name); break;
+		case OBJECT_NATIVE_FUNCTION: writeName(((ObjectNativeFunction*) object)->name); break;
+		case OBJECT_CLOSURE: writeName(((ObjectClosure*) object)->function->name); break;
+		case OBJECT_CLASS: writeName(((ObjectClass*) object)->name); break;
+		case OBJECT_INSTANCE: writeName(((ObjectInstance*) object)->Class->name); break;
+		case OBJECT_BOUND_METHOD: writeName(((ObjectBoundMethod*) object)->closure->function->name); break;
+		case OBJECT_UPVALUE: fprintf(file, "-"); break;
+		// Walking the rope would take as long as flattening it
+		case OBJECT_ROPE: fprintf(file, "(%d characters)", ((ObjectRope*) object)->length); break;
+	}
+}
+
+static void writeObject(Object* object){
+	fprintf(file, "object\t");
+	writeAddress(object);
+	fprintf(file, "\t%s\t%zu\t", objectTypeName(object->objectType), snapshotSize(object));
+	writeLabel(object);
+	fprintf(file, "\t");
+
+	collectReferences(object);
+	for (int i=0; i < references.count; i++){
+		if (i > 0) fprintf(file, " ");
+		writeAddress(references.objects[i]);
+		if (visitObject(references.objects[i])) appendObject(&pending, references.objects[i]);
+	}
+	fprintf(file, "\n");
+}
+
+// Walks the object graph without touching the mark bits, so it can run in the middle of an incremental gc cycle
+// Returns false if the file could not be written
+bool writeHeapSnapshot(const char* path){
+	file = fopen(path, "w");
+	if (file == NULL) return false;
+
+	visited = (ObjectList) {NULL, 0, 0};
+	pending = (ObjectList) {NULL, 0, 0};
+	references = (ObjectList) {NULL, 0, 0};
+
+	fprintf(file, "# clox heap snapshot\n");
+	addRoots();
+	while (pending.count > 0){
+		writeObject(pending.objects[--pending.count]);
+	}
+
+	free(visited.objects);
+	free(pending.objects);
+	free(references.objects);
+	bool isWritten = !ferror(file);
+	return fclose(file) == 0 && isWritten;
+}
@@ -0,0 +1,17 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "../common.h"
+
+// Heap snapshots list every object reachable from the roots the gc marks, in a tab separated text file:
+//   root    <kind>    <address>
+//   object  <address> <type> <size> <label> <addresses of the objects it references, separated by spaces>
+// The size counts what the object owns outside of itself (character arrays, chunks, ...), shapes aside
+// The label is the class name of instances and classes, the name of functions, closures and bound methods,
+// and the (escaped, truncated) characters of strings
+// See "debug/heapsummary.h" for the summary of a snapshot
+
+// function prototypes
+bool writeHeapSnapshot(const char* path);
+
+#endif
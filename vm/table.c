@@ -4,12 +4,181 @@
 #include "string.h"
 #include "vm.h"
 
+#ifdef SWISS_TABLE
+#include <emmintrin.h>
+#endif
+
 void initTable(Table* table){
 	table->count=0;
 	table->capacity=0;
+	#ifdef SWISS_TABLE
+	table->keys = NULL;
+	table->values = NULL;
+	table->control = NULL;
+	#else
 	table->entries=NULL;
+	#endif
 }
 
+#ifdef SWISS_TABLE
+
+#define CONTROL_EMPTY 0x80
+#define CONTROL_TAG(hash) ((uint8_t) ((hash) >> 25))
+
+// The keys, values and control bytes share a single allocation, starting with the keys
+void freeTable(Table* table){
+	reallocate(table->keys, TABLE_SLOTS_SIZE(table->capacity), 0);
+	initTable(table);
+}
+
+// Bit i is set if the control byte of slot `index + i` is `tag`
+static inline uint32_t matchTag(const uint8_t* group, uint8_t tag){
+	__m128i bytes = _mm_loadu_si128((const __m128i*) group);
+	return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char) tag)));
+}
+
+// Only CONTROL_EMPTY has its top bit set
+static inline uint32_t matchEmpty(const uint8_t* group){
+	return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) group));
+}
+
+static inline void setControl(Table* table, int index, uint8_t control){
+	table->control[index] = control;
+	if (index < GROUP_SIZE) table->control[table->capacity + index] = control;
+}
+
+// Slot of the key, or of the empty slot it would take if the table does not have it
+static int findSlot(Table* table, ObjectString* key){
+	int mask = table->capacity - 1;
+	uint8_t tag = CONTROL_TAG(key->hash);
+	int index = key->hash & mask;
+
+	while (true){
+		const uint8_t* group = table->control + index;
+		for (uint32_t matches = matchTag(group, tag); matches != 0; matches &= matches - 1){
+			int slot = (index + __builtin_ctz(matches)) & mask;
+			if (table->keys[slot] == key) return slot;
+		}
+		uint32_t empty = matchEmpty(group);
+		if (empty != 0) return (index + __builtin_ctz(empty)) & mask;
+		index = (index + GROUP_SIZE) & mask;
+	}
+}
+
+static void resizeTable(Table* table, int capacity){
+	Table resized;
+	resized.count = 0;
+	resized.capacity = capacity;
+	resized.keys = (ObjectString**) reallocate(NULL, 0, TABLE_SLOTS_SIZE(capacity));
+	resized.values = (Value*) (resized.keys + capacity);
+	resized.control = (uint8_t*) (resized.values + capacity);
+	for (int i=0; i < capacity; i++){
+		resized.keys[i] = NULL;
+	}
+	memset(resized.control, CONTROL_EMPTY, capacity + GROUP_SIZE);
+
+	for (int i=0; i < table->capacity; i++){
+		ObjectString* key = table->keys[i];
+		if (key == NULL) continue;
+		int slot = findSlot(&resized, key);
+		resized.keys[slot] = key;
+		resized.values[slot] = table->values[i];
+		setControl(&resized, slot, CONTROL_TAG(key->hash));
+		resized.count++;
+	}
+
+	freeTable(table);
+	*table = resized;
+}
+
+void tableAdd(Table* table, ObjectString* key, Value value){
+	// allocate and resize if necessary
+	if (table->count + 1 > table->capacity * MAX_TABLE_LOAD) {
+		int capacity = table->capacity < GROUP_SIZE ? GROUP_SIZE : table->capacity * 2;
+
+		// Push the key and the value onto the heap just in case the GC runs while the table is resized so that we don't lose these objects
+		push(OBJECT(key));
+		push(value);
+		resizeTable(table, capacity);
+
+		// pop afterwards
+		pop();
+		pop();
+	}
+
+	int slot = findSlot(table, key);
+	if (table->keys[slot] == NULL){
+		table->count++;
+		table->keys[slot] = key;
+		setControl(table, slot, CONTROL_TAG(key->hash));
+	}
+	table->values[slot] = value;
+}
+
+bool tableHas(Table* table, ObjectString* key){
+	if (table->capacity == 0) return false;
+	return table->keys[findSlot(table, key)] != NULL;
+}
+
+Value tableGet(Table* table, ObjectString* key){
+	if (table->capacity == 0) return NIL;
+	int slot = findSlot(table, key);
+	return table->keys[slot] == NULL ? NIL : table->values[slot];
+}
+
+// Backward shift deletion: the entries after the hole move back into it, unless that would put them before the slot their hash starts at,
+// so that every entry stays reachable from its first slot without going through an empty one
+bool tableDelete(Table* table, ObjectString* key){
+	if (table->count == 0) return false;
+
+	int hole = findSlot(table, key);
+	if (table->keys[hole] == NULL) return false;
+
+	int mask = table->capacity - 1;
+	for (int next = (hole + 1) & mask; table->keys[next] != NULL; next = (next + 1) & mask){
+		int home = table->keys[next]->hash & mask;
+		if (((next - home) & mask) < ((next - hole) & mask)) continue;
+
+		table->keys[hole] = table->keys[next];
+		table->values[hole] = table->values[next];
+		setControl(table, hole, table->control[next]);
+		hole = next;
+	}
+	table->keys[hole] = NULL;
+	setControl(table, hole, CONTROL_EMPTY);
+	table->count--;
+	return true;
+}
+
+// `replacement` is the copy of a key that moved, with the same hash
+void tableReplaceKey(Table* table, ObjectString* key, ObjectString* replacement){
+	if (table->capacity == 0) return;
+	int slot = findSlot(table, key);
+	if (table->keys[slot] == key) table->keys[slot] = replacement;
+}
+
+ObjectString* tableFindString(Table* table, const char* string, int length, uint32_t hash){
+	if (table->capacity == 0) return NULL;
+
+	int mask = table->capacity - 1;
+	uint8_t tag = CONTROL_TAG(hash);
+	int index = hash & mask;
+
+	while (true){
+		const uint8_t* group = table->control + index;
+		for (uint32_t matches = matchTag(group, tag); matches != 0; matches &= matches - 1){
+			ObjectString* key = table->keys[(index + __builtin_ctz(matches)) & mask];
+			if (key->hash == hash && key->length == length && memcmp(key->string, string, length) == 0) return key;
+		}
+		if (matchEmpty(group) != 0) return NULL;
+		index = (index + GROUP_SIZE) & mask;
+	}
+}
+
+#else
+
+static Entry* tableFind(Entry*, int, ObjectString*);
+static void adjustHashTable(Table*, int);
 
 void freeTable(Table* table){
 	FREE_ARRAY(Entry, table->entries, table->capacity);
@@ -40,8 +209,8 @@ void tableAdd(Table* table, ObjectString* key, Value value){
 	entry->value= value;
 }
 
-Entry* tableFind(Entry* initialEntry, int capacity, ObjectString* key){
-	int index = key->hash % capacity;
+static Entry* tableFind(Entry* initialEntry, int capacity, ObjectString* key){
+	uint32_t index = key->hash & (capacity - 1);
 
 	Entry* tombstone = NULL;
 	Entry* entry = NULL;
@@ -57,7 +226,7 @@ Entry* tableFind(Entry* initialEntry, int capacity, ObjectString* key){
 
 		} else if (entry->key == key) return entry;
 
-		index = (index + 1) % capacity;
+		index = (index + 1) & (capacity - 1);
 	}
 	return entry;
 }
@@ -86,7 +255,14 @@ bool tableDelete(Table* table, ObjectString* key){
 	return true;
 }
 
-void adjustHashTable(Table* table, int capacity){
+// `replacement` is the copy of a key that moved, with the same hash
+void tableReplaceKey(Table* table, ObjectString* key, ObjectString* replacement){
+	if (table->capacity == 0) return;
+	Entry* entry = tableFind(table->entries, table->capacity, key);
+	if (entry->key == key) entry->key = replacement;
+}
+
+static void adjustHashTable(Table* table, int capacity){
 	// Allocate memory
 	Entry* entries = (Entry*) reallocate(NULL, sizeof(Entry) * table->capacity, sizeof(Entry) * capacity);
 	for (int i=0; i < capacity; i++){
@@ -118,7 +294,7 @@ ObjectString* tableFindString(Table* table, const char* string, int length, uint
 	if (table->capacity == 0) return NULL;
 
 	int capacity = table->capacity;
-	int index = hash % capacity;
+	uint32_t index = hash & (capacity - 1);
 
 	Entry* entry = NULL;
 
@@ -131,6 +307,8 @@ ObjectString* tableFindString(Table* table, const char* string, int length, uint
 			   return entry->key;
 		}
 
-		index = (index + 1) % capacity;
+		index = (index + 1) & (capacity - 1);
 	}
 }
+
+#endif
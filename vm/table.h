@@ -5,6 +5,32 @@
 
 #define MAX_TABLE_LOAD 0.75
 
+#ifdef SWISS_TABLE
+
+// Swiss table: a control byte per slot, probed GROUP_SIZE slots at a time with SSE2, and the keys and values in arrays of their own
+// so that a probe only touches the control bytes, and the keys of the slots whose control byte matched
+// Linear probing (by slot, not by group) lets a deletion shift the entries that follow back, instead of leaving a tombstone
+#define GROUP_SIZE 16
+
+typedef struct Table{
+	int count;
+	// 0, or a power of two no smaller than GROUP_SIZE
+	int capacity;
+	// NULL in empty slots
+	ObjectString** keys;
+	Value* values;
+	// CONTROL_EMPTY, or the top 7 bits of the hash of the key, followed by a copy of the first GROUP_SIZE bytes
+	// so that the groups starting near the end of the table wrap around
+	uint8_t* control;
+} Table;
+
+#define TABLE_KEY(table, index) ((table)->keys[index])
+#define TABLE_VALUE(table, index) ((table)->values[index])
+// Bytes allocated for the slots of a table
+#define TABLE_SLOTS_SIZE(capacity) ((capacity) * (sizeof(ObjectString*) + sizeof(Value) + 1) + ((capacity) > 0 ? GROUP_SIZE : 0))
+
+#else
+
 typedef struct{
 	ObjectString* key;
 	Value value;
@@ -12,21 +38,27 @@ typedef struct{
 
 typedef struct Table{
 	int count;
+	// A power of two (see GROW_CAPACITY), so that probing masks the hash instead of dividing it
 	int capacity;
 	Entry* entries;
 } Table;
 
+#define TABLE_KEY(table, index) ((table)->entries[index].key)
+#define TABLE_VALUE(table, index) ((table)->entries[index].value)
+#define TABLE_SLOTS_SIZE(capacity) ((capacity) * sizeof(Entry))
+
+#endif
+
 // function prototypes
 void initTable(Table*);
 void freeTable(Table*);
 
 void tableAdd(Table*, ObjectString*, Value);
-Entry* tableFind(Entry*,int,ObjectString*);
 bool tableHas(Table*, ObjectString*);
 Value tableGet(Table*, ObjectString*);
 bool tableDelete(Table*, ObjectString*);
+void tableReplaceKey(Table*, ObjectString*, ObjectString*);
 
-void adjustHashTable(Table*, int);
 ObjectString* tableFindString(Table*, const char*, int, uint32_t);
 
 #endif
@@ -36,25 +36,19 @@ void freeValueArray(ValueArray* array){
 }
 
 void printValue(Value value){
-	switch(value.type){
-		case TYPE_NUM:
-			{
-				double val = AS_NUM(value);
-				if (fmod(val, 1) == 0) printf("%d", (int) AS_NUM(value));
-				else printf("%lf", AS_NUM(value));
-			}
-			break;
-		case TYPE_BOOL:
-			printf("%s", (AS_BOOL(value) == true) ? "true" : "false");
-			break;
-		case TYPE_NIL:
-			printf("nil");
-			break;
-		case TYPE_OBJ:
-			printObject(AS_OBJ(value));
-			break;
-		default:
-			break;
+	if (IS_NUM(value)){
+		double val = AS_NUM(value);
+		if (fmod(val, 1) == 0) printf("%d", (int) AS_NUM(value));
+		else printf("%lf", AS_NUM(value));
+
+	} else if (IS_BOOL(value)){
+		printf("%s", (AS_BOOL(value) == true) ? "true" : "false");
+
+	} else if (IS_NIL(value)){
+		printf("nil");
+
+	} else if (IS_OBJ(value)){
+		printObject(AS_OBJ(value));
 	}
 }
 
@@ -66,6 +60,9 @@ void printObject(Object* object){
 				printf("%s", objString->string);
 			}
 			break;
+		case OBJECT_ROPE:
+			printf("%s", flattenRope((ObjectRope*) object)->string);
+			break;
 		case OBJECT_FUNCTION:
 			printFunction((ObjectFunction *)object);
 			break;
@@ -114,22 +111,24 @@ void printFunction(ObjectFunction* function) {
 }
 
 bool checkIfValuesEqual(Value val1, Value val2){
-	if (val1.type != val2.type) return false;
-	switch (val1.type){
-		case TYPE_NIL: return true;
-		case TYPE_NUM: return AS_NUM(val1) == AS_NUM(val2);
-		case TYPE_BOOL: return AS_BOOL(val1) == AS_BOOL(val2);
-		case TYPE_OBJ: return checkIfObjectsEqual(AS_OBJ(val1), AS_OBJ(val2));
-		default: return false;
-	}
+	if (IS_NUM(val1)) return IS_NUM(val2) && AS_NUM(val1) == AS_NUM(val2);
+	if (IS_BOOL(val1)) return IS_BOOL(val2) && AS_BOOL(val1) == AS_BOOL(val2);
+	if (IS_NIL(val1)) return IS_NIL(val2);
+	if (IS_OBJ(val1)) return IS_OBJ(val2) && checkIfObjectsEqual(AS_OBJ(val1), AS_OBJ(val2));
+	return false;
 }
 
 bool checkIfObjectsEqual(Object* obj1, Object* obj2){
 	switch(obj1->objectType){
 		case OBJECT_STRING:
+		case OBJECT_ROPE:
 			{
-				if (obj2->objectType != OBJECT_STRING) return false;
-				return obj1 == obj2;
+				// Strings are interned, ropes are compared by their flattened string
+				if (obj1 == obj2) return true;
+				if (obj2->objectType != OBJECT_STRING && obj2->objectType != OBJECT_ROPE) return false;
+				if (obj1->objectType == OBJECT_STRING && obj2->objectType == OBJECT_STRING) return false;
+				if (stringLength(obj1) != stringLength(obj2)) return false;
+				return flattenString(obj1) == flattenString(obj2);
 			}
 		case OBJECT_FUNCTION:
 			{
@@ -3,14 +3,32 @@
 
 #include <stdbool.h>
 #include <math.h>
+#include <string.h>
 #include "object.h"
 
+#ifdef NAN_BOXING
+
+// Every Value is a single 64-bit word.
+// Numbers are stored as plain doubles, everything else hides inside the unused bits of a quiet NaN
+#define SIGN_BIT ((uint64_t) 0x8000000000000000)
+#define QNAN ((uint64_t) 0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_UNDEFINED 4
+
+typedef uint64_t Value;
+
+#else
+
 // enum declaration
 typedef enum{
 	TYPE_NUM,
 	TYPE_BOOL,
 	TYPE_NIL,
-	TYPE_OBJ
+	TYPE_OBJ,
+	TYPE_UNDEFINED
 } ValueType;
 
 // struct declaration
@@ -23,6 +41,8 @@ typedef struct Value{
 	} as;
 } Value;
 
+#endif
+
 typedef struct{
 	int count;
 	int capacity;
@@ -36,6 +56,21 @@ typedef struct ObjectUpvalue{
 	Value closedValue;
 } ObjectUpvalue;
 
+// ObjectInstance struct defined here instead of "object.h" too since it stores values
+typedef struct ObjectInstance{
+	Object object;
+	ObjectClass* Class;
+	// Layout of `fields`, see "shape.h"
+	struct Shape* shape;
+	// Points to `inlineFields` until the instance outgrows them and the fields move to the heap
+	Value* fields;
+	int fieldCapacity;
+	int inlineCapacity;
+	// Only used in dictionary mode
+	struct Table* dictionary;
+	Value inlineFields[];
+} ObjectInstance;
+
 // function prototypes
 void initValueArray(ValueArray*);
 void appendValue(ValueArray*, Value);
@@ -50,31 +85,74 @@ bool checkIfObjectsEqual(Object*,Object*);
 
 // Useful macros
 
+#ifdef NAN_BOXING
+
+#define FALSE_VAL ((Value) (uint64_t) (QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value) (uint64_t) (QNAN | TAG_TRUE))
+
+#define BOOLEAN(value) ((Value) (FALSE_VAL | ((value) ? 1 : 0)))
+#define NUMBER(value) numberToValue(value)
+#define NIL ((Value) (uint64_t) (QNAN | TAG_NIL))
+#define UNDEFINED ((Value) (uint64_t) (QNAN | TAG_UNDEFINED))
+#define OBJECT(obj) ((Value) (SIGN_BIT | QNAN | (uint64_t) (uintptr_t) (obj)))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUM(value) valueToNumber(value)
+#define AS_OBJ(value) ((Object*) (uintptr_t) ((value) & ~(SIGN_BIT | QNAN)))
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED)
+#define IS_NUM(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+static inline double valueToNumber(Value value){
+	double number;
+	memcpy(&number, &value, sizeof(Value));
+	return number;
+}
+
+static inline Value numberToValue(double number){
+	Value value;
+	memcpy(&value, &number, sizeof(double));
+	return value;
+}
+
+#else
+
 #define BOOLEAN(value) ((Value) {.type=TYPE_BOOL, .as.boolean=value})
 #define NUMBER(value) ((Value) {.type=TYPE_NUM, .as.number=value})
 #define NIL ((Value) {.type=TYPE_NIL, .as.number=0})
-#define OBJECT(obj) (Value) {.type=TYPE_OBJ, .as.object = (Object*) obj}
-
-#define AS_BOOL(value) value.as.boolean
-#define AS_NUM(value) value.as.number
-#define AS_OBJ(value) value.as.object
-#define AS_STRING_OBJ(value) (ObjectString*) value.as.object
-#define AS_FUNCTION_OBJ(value) (ObjectFunction*) value.as.object
-#define AS_CLOSURE_OBJ(value) (ObjectClosure*) value.as.object
-#define AS_NATIVE_FUNCTION_OBJ(value) (ObjectNativeFunction*) value.as.object
-#define AS_CLASS_OBJ(value) (ObjectClass*) value.as.object
-#define AS_INSTANCE_OBJ(value) (ObjectInstance*) value.as.object
-#define AS_BOUND_METHOD_OBJ(value) (ObjectBoundMethod*) value.as.object
-
-#define IS_BOOL(value) value.type == TYPE_BOOL
-#define IS_NIL(value) value.type == TYPE_NIL
-#define IS_NUM(value) value.type == TYPE_NUM
-#define IS_OBJ(value) value.type == TYPE_OBJ
-#define IS_STRING(value) IS_OBJ(value) && (AS_OBJ(value)->objectType == OBJECT_STRING)
-#define IS_FUNCTION(value) IS_OBJ(value) && (AS_OBJ(value)->objectType == OBJECT_FUNCTION)
-#define IS_CLOSURE(value) IS_OBJ(value) && (AS_OBJ(value)->objectType == OBJECT_CLOSURE)
-#define IS_CLASS(value) IS_OBJ(value) && (AS_OBJ(value)->objectType == OBJECT_CLASS)
-#define IS_INSTANCE(value) IS_OBJ(value) && (AS_OBJ(value)->objectType == OBJECT_INSTANCE)
-#define IS_BOUND_METHOD(value) IS_OBJ(value) && (AS_OBJ(value)->objectType == OBJECT_BOUND_METHOD)
+#define UNDEFINED ((Value) {.type=TYPE_UNDEFINED, .as.number=0})
+#define OBJECT(obj) ((Value) {.type=TYPE_OBJ, .as.object = (Object*) obj})
+
+#define AS_BOOL(value) ((value).as.boolean)
+#define AS_NUM(value) ((value).as.number)
+#define AS_OBJ(value) ((value).as.object)
+
+#define IS_BOOL(value) ((value).type == TYPE_BOOL)
+#define IS_NIL(value) ((value).type == TYPE_NIL)
+#define IS_UNDEFINED(value) ((value).type == TYPE_UNDEFINED)
+#define IS_NUM(value) ((value).type == TYPE_NUM)
+#define IS_OBJ(value) ((value).type == TYPE_OBJ)
+
+#endif
+
+#define AS_STRING_OBJ(value) ((ObjectString*) AS_OBJ(value))
+#define AS_FUNCTION_OBJ(value) ((ObjectFunction*) AS_OBJ(value))
+#define AS_CLOSURE_OBJ(value) ((ObjectClosure*) AS_OBJ(value))
+#define AS_NATIVE_FUNCTION_OBJ(value) ((ObjectNativeFunction*) AS_OBJ(value))
+#define AS_CLASS_OBJ(value) ((ObjectClass*) AS_OBJ(value))
+#define AS_INSTANCE_OBJ(value) ((ObjectInstance*) AS_OBJ(value))
+#define AS_BOUND_METHOD_OBJ(value) ((ObjectBoundMethod*) AS_OBJ(value))
+
+#define IS_OBJ_TYPE(value, type) (IS_OBJ(value) && (AS_OBJ(value)->objectType == type))
+#define IS_STRING(value) IS_OBJ_TYPE(value, OBJECT_STRING)
+#define IS_STRING_OR_ROPE(value) (IS_OBJ(value) && (AS_OBJ(value)->objectType == OBJECT_STRING || AS_OBJ(value)->objectType == OBJECT_ROPE))
+#define IS_FUNCTION(value) IS_OBJ_TYPE(value, OBJECT_FUNCTION)
+#define IS_CLOSURE(value) IS_OBJ_TYPE(value, OBJECT_CLOSURE)
+#define IS_CLASS(value) IS_OBJ_TYPE(value, OBJECT_CLASS)
+#define IS_INSTANCE(value) IS_OBJ_TYPE(value, OBJECT_INSTANCE)
+#define IS_BOUND_METHOD(value) IS_OBJ_TYPE(value, OBJECT_BOUND_METHOD)
 
 #endif
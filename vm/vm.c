@@ -3,6 +3,8 @@
 #include "object.h"
 #include "../compiler/compiler.h"
 #include "../debug/disassembler.h"
+#include "shape.h"
+#include "snapshot.h"
 
 #include <stdio.h>
 #include <stdarg.h>
@@ -13,16 +15,26 @@
 VM vm;
 
 void initVM(bool end){
-	vm.objects = NULL;
+	// Before anything allocates: allocations count down to the next sample
+	initProfiler();
+	initSlab();
+	#ifdef GENERATIONAL_GC
+	initNursery();
+	#endif
 	vm.frameCount = 0;
 	initTable(&vm.strings);
-	initTable(&vm.globals);
+	initTable(&vm.globalSlots);
+	initValueArray(&vm.globalValues);
+	initValueArray(&vm.globalNames);
 	resetStack();
 	resetOpenObjUpvalues();
-	vm.gc = (GC) {.count=0, .capacity=0, .objectsQueue=NULL};
+	initGC();
 	vm.bytesAllocated = 0;
-	vm.nextGCRun = INITIAL_GC_TRIGGER_VALUE;
+	scheduleGC(vm.gc.initialTrigger);
+	initValueArray(&vm.selectorNames);
+	vm.init = NULL;
 	vm.init = makeStringObject("init",4);
+	getSelector(vm.init);
 
 	if (!end) declareNativeFunctions();
 }
@@ -48,6 +60,13 @@ void setupFrameForClosureCall(ObjectClosure* objClosure, CallFrame** frame, int
 
 // Interpret function for VM							
 InterpreterResult interpret(const char* source){
+	vm.frameCount = 0;
+
+	// The runtime error was reported by the allocation that went over the heap limit, which left the compiler where it was
+	if (setjmp(vm.heapLimitExceeded) != 0){
+		currentCompiler = NULL;
+		return RUNTIME_ERROR;
+	}
 
 	ObjectFunction* currentFunction = compile(source);
 	if (currentFunction == NULL){
@@ -70,425 +89,826 @@ InterpreterResult runVM(){
 	
 	CallFrame* frame = &vm.frames[vm.frameCount++];
 
-	#define READ_BYTE() *(frame->ip++)
-	#define READ_CONSTANT() (frame->closure->function->chunk->constants).values[READ_BYTE()]
-	#define READ_2BYTES() ((uint16_t) (*frame->ip << 8)) + *(frame->ip+1)
-		
-
-	#define BYTES_LEFT_TO_EXECUTE() (frame->ip < (frame->closure->function->chunk->code + frame->closure->function->chunk->count))
-
-	#define BINARY_OP(resultValue, op, type) \
-			do { 	Value b = peek(0); Value a=peek(1); \
+	// The hot interpreter state is cached in locals so that the C compiler can keep it in registers
+	// `frame->ip` and `vm.stackpointer` are only brought up to date (spilled) before anything outside of this loop can observe them:
+	// calls and returns, allocations (the GC scans the stack), runtime errors (line numbers are read from `frame->ip`) and native functions
+	uint8_t* ip;
+	Value* stackpointer;
+	Value* stackStart;
+	Value* constants;
+	InlineCache* caches;
+
+	#define SAVE_STATE() \
+			do { \
+				frame->ip = ip; \
+				vm.stackpointer = stackpointer; \
+			} while (false)
+
+	#define LOAD_STATE() \
+			do { \
+				frame = &vm.frames[vm.frameCount - 1]; \
+				ip = frame->ip; \
+				stackStart = frame->stackStart; \
+				constants = frame->closure->function->chunk->constants.values; \
+				caches = frame->closure->function->chunk->caches; \
+				stackpointer = vm.stackpointer; \
+			} while (false)
+
+	#define PUSH(value) \
+			do { \
+				Value pushed = (value); \
+				*(stackpointer++) = pushed; \
+			} while (false)
+	#define POP() (*(--stackpointer))
+	#define DROP() (stackpointer--)
+	#define PEEK(depth) (*(stackpointer - (depth) - 1))
+
+	#define READ_BYTE() (*(ip++))
+	#define READ_CONSTANT() (constants[READ_BYTE()])
+	#define READ_2BYTES() ((uint16_t) ((*ip << 8) | *(ip+1)))
+	#define READ_SHORT() (ip += 2, (uint16_t) ((*(ip-2) << 8) | *(ip-1)))
+	#define READ_CACHE() (caches + READ_SHORT())
+
+	#define BYTES_LEFT_TO_EXECUTE() (ip < (frame->closure->function->chunk->code + frame->closure->function->chunk->count))
+
+	#define RAISE_RUNTIME_ERROR(...) \
+			do { \
+				SAVE_STATE(); \
+				runtimeError(__VA_ARGS__); \
+				return RUNTIME_ERROR; \
+			} while (false)
+
+	// `a <= b` is `!(a > b)` and `a >= b` is `!(a < b)`, like the comparison and OP_NOT the compiler used to emit for them,
+	// so both are true when an operand is NaN
+	#define NOT_BOOLEAN(value) BOOLEAN(!(value))
+
+	// Generic binary operation: checks the operand types, and quickens the instruction
+	// (rewrites the opcode just read) into `quickType` once it has seen two numbers
+	#define BINARY_OP(resultValue, op, type, quickType) \
+			do { 	Value b = PEEK(0); Value a=PEEK(1); \
 				if (IS_NUM(b) && IS_NUM(a)){ \
-			 		double d = AS_NUM(pop()); double c=AS_NUM(pop()); \
-			  		push(resultValue(c op d)); \
+			 		double d = AS_NUM(POP()); double c=AS_NUM(POP()); \
+			  		PUSH(resultValue(c op d)); \
+					*(ip-1) = quickType; \
 				} \
-				else if (type == OP_ADD && IS_STRING(b) && IS_STRING(a)){ \
-					push(OBJECT(concatenate())); \
+				else if (type == OP_ADD && IS_STRING_OR_ROPE(b) && IS_STRING_OR_ROPE(a)){ \
+					SAVE_STATE(); \
+					Object* result = concatenate(); \
+					stackpointer = vm.stackpointer; \
+					PUSH(OBJECT(result)); \
+					*(ip-1) = OP_ADD_STR_STR; \
 				} else if (type == OP_ADD){\
-					runtimeError("Operands must be two numbers or two strings");\
-					return RUNTIME_ERROR;\
+					RAISE_RUNTIME_ERROR("Operands must be two numbers or two strings");\
 				} else{ \
-					runtimeError("Operands must be numbers");\
-					return RUNTIME_ERROR;\
+					RAISE_RUNTIME_ERROR("Operands must be numbers");\
 				} \
 			} while (false) \
 		
 
+	// Rewrites a quickened instruction back to its generic opcode and re-executes it
+	// Not wrapped in do/while since `NEXT` has to leave the instruction
+	#define DEQUICKEN(type) \
+			{ \
+				*(--ip) = type; \
+				NEXT; \
+			}
+
+	// Quickened binary operation on two numbers, guarded by a type check on the operands
+	#define NUM_NUM_OP(resultValue, op, type) \
+			{ \
+				Value b = PEEK(0); Value a = PEEK(1); \
+				if (!(IS_NUM(a) && IS_NUM(b))) DEQUICKEN(type); \
+				DROP(); \
+				PEEK(0) = resultValue(AS_NUM(a) op AS_NUM(b)); \
+			}
+
+	// An inline cache hit costs a pointer comparison:
+	// the instance has the shape the field was found in, or the receiver class (and its version) is the one the method was resolved for
+	#define IS_CACHED_FIELD(cache, instance) ((cache)->shape == (instance)->shape)
+	// Stores also need room for the slot when they add the field
+	#define IS_CACHED_STORE(cache, instance) ((cache)->shape == (instance)->shape && (cache)->slot < (instance)->fieldCapacity)
+	#define IS_CACHED_METHOD(cache, class) \
+			((cache)->Class == (class) && (cache)->classVersion == (class)->version)
+
+	// Calls a closure whose receiver (or the closure itself) and arguments are already on the stack
+	#define CALL_METHOD(closure, nargs) \
+			do { \
+				ObjectClosure* calledMethod = (closure); \
+				SAVE_STATE(); \
+				if (calledMethod->function->arity != (nargs) || vm.frameCount == CALL_FRAMES_MAX){ \
+					callNoErrors((nargs), OBJECT(calledMethod)); \
+					return RUNTIME_ERROR; \
+				} \
+				setupFrameForClosureCall(calledMethod, &frame, (nargs)); \
+				LOAD_STATE(); \
+			} while (false)
+
+	// Pops both operands, compares them and jumps if the comparison is `jumpsIf`
+	#define COMPARE_AND_JUMP(op, jumpsIf) \
+			do { \
+				uint16_t offset = READ_2BYTES(); \
+				Value b = PEEK(0); Value a = PEEK(1); \
+				if (!(IS_NUM(a) && IS_NUM(b))){ \
+					ip += 2; \
+					RAISE_RUNTIME_ERROR("Operands must be numbers"); \
+				} \
+				stackpointer -= 2; \
+				ip += ((AS_NUM(a) op AS_NUM(b)) == (jumpsIf)) ? offset : 2; \
+			} while (false)
+
+	#ifdef GENERATIONAL_GC
+	// Minor gcs (and the compactions following them) move objects, so they only run at safepoints: loop back edges and returns, where every object the vm uses is reachable from the stack or the frames
+	// A pending compaction fills the nursery to get here, since it has to empty it first anyway
+	#define SAFEPOINT() \
+			do { \
+				if (vm.nursery.isFull){ \
+					SAVE_STATE(); \
+					collectNursery(); \
+					LOAD_STATE(); \
+				} \
+			} while (false)
+	#else
+	#define SAFEPOINT() \
+			do { \
+				if (vm.gc.isCompactionPending){ \
+					SAVE_STATE(); \
+					compactHeap(); \
+					LOAD_STATE(); \
+				} \
+			} while (false)
+	#endif
+
+	#ifdef DEBUG_TRACE_EXECUTION
+	#define TRACE_INSTRUCTION() \
+			do { \
+				SAVE_STATE(); \
+				disassembleVMStack(); \
+				disassembleInstruction(frame->closure->function->chunk, (int) (ip - frame->closure->function->chunk->code)); \
+			} while (false)
+	#else
+	#define TRACE_INSTRUCTION() do {} while (false)
+	#endif
+
+	#ifdef COMPUTED_GOTO
+	// Direct threaded dispatch: every instruction jumps straight to the handler of the next one
+	// Every compiler emits an OP_RETURN at the end of a chunk, so there is no need to check for the end of the chunk
+	static void* dispatchTable[UINT8_T_LIMIT + 1] = {
+		[0 ... UINT8_T_LIMIT] = &&UNKNOWN_OPCODE,
+		[OP_RETURN] = &&TARGET_OP_RETURN,
+		[OP_CONSTANT] = &&TARGET_OP_CONSTANT,
+		[OP_NEGATE] = &&TARGET_OP_NEGATE,
+		[OP_ADD] = &&TARGET_OP_ADD,
+		[OP_SUBTRACT] = &&TARGET_OP_SUBTRACT,
+		[OP_MULTIPLY] = &&TARGET_OP_MULTIPLY,
+		[OP_DIVIDE] = &&TARGET_OP_DIVIDE,
+		[OP_TRUE] = &&TARGET_OP_TRUE,
+		[OP_FALSE] = &&TARGET_OP_FALSE,
+		[OP_NIL] = &&TARGET_OP_NIL,
+		[OP_NOT] = &&TARGET_OP_NOT,
+		[OP_EQUAL] = &&TARGET_OP_EQUAL,
+		[OP_GT] = &&TARGET_OP_GT,
+		[OP_LT] = &&TARGET_OP_LT,
+		[OP_POP] = &&TARGET_OP_POP,
+		[OP_POP_UPVALUE] = &&TARGET_OP_POP_UPVALUE,
+		[OP_PRINT] = &&TARGET_OP_PRINT,
+		[OP_DEFINE_GLOBAL_SLOT] = &&TARGET_OP_DEFINE_GLOBAL_SLOT,
+		[OP_GET_GLOBAL_SLOT] = &&TARGET_OP_GET_GLOBAL_SLOT,
+		[OP_SET_GLOBAL_SLOT] = &&TARGET_OP_SET_GLOBAL_SLOT,
+		[OP_GET_LOCAL] = &&TARGET_OP_GET_LOCAL,
+		[OP_SET_LOCAL] = &&TARGET_OP_SET_LOCAL,
+		[OP_GET_UPVALUE] = &&TARGET_OP_GET_UPVALUE,
+		[OP_SET_UPVALUE] = &&TARGET_OP_SET_UPVALUE,
+		[OP_JUMP_IF_FALSE] = &&TARGET_OP_JUMP_IF_FALSE,
+		[OP_JUMP_IF_TRUE] = &&TARGET_OP_JUMP_IF_TRUE,
+		[OP_JUMP] = &&TARGET_OP_JUMP,
+		[OP_LOOP] = &&TARGET_OP_LOOP,
+		[OP_CALL] = &&TARGET_OP_CALL,
+		[OP_CLOSURE] = &&TARGET_OP_CLOSURE,
+		[OP_CLASS] = &&TARGET_OP_CLASS,
+		[OP_GET_PROPERTY] = &&TARGET_OP_GET_PROPERTY,
+		[OP_SET_PROPERTY] = &&TARGET_OP_SET_PROPERTY,
+		[OP_METHOD] = &&TARGET_OP_METHOD,
+		[OP_FAST_METHOD_CALL] = &&TARGET_OP_FAST_METHOD_CALL,
+		[OP_INHERIT_SUPERCLASS] = &&TARGET_OP_INHERIT_SUPERCLASS,
+		[OP_STACK_SWAP] = &&TARGET_OP_STACK_SWAP,
+		[OP_GET_SUPER] = &&TARGET_OP_GET_SUPER,
+		[OP_FAST_SUPER_METHOD_CALL] = &&TARGET_OP_FAST_SUPER_METHOD_CALL,
+		[OP_NOT_EQUAL] = &&TARGET_OP_NOT_EQUAL,
+		[OP_LE] = &&TARGET_OP_LE,
+		[OP_GE] = &&TARGET_OP_GE,
+		[OP_POP_JUMP_IF_FALSE] = &&TARGET_OP_POP_JUMP_IF_FALSE,
+		[OP_EQUAL_JUMP_IF_FALSE] = &&TARGET_OP_EQUAL_JUMP_IF_FALSE,
+		[OP_NOT_EQUAL_JUMP_IF_FALSE] = &&TARGET_OP_NOT_EQUAL_JUMP_IF_FALSE,
+		[OP_LT_JUMP_IF_FALSE] = &&TARGET_OP_LT_JUMP_IF_FALSE,
+		[OP_LE_JUMP_IF_FALSE] = &&TARGET_OP_LE_JUMP_IF_FALSE,
+		[OP_GT_JUMP_IF_FALSE] = &&TARGET_OP_GT_JUMP_IF_FALSE,
+		[OP_GE_JUMP_IF_FALSE] = &&TARGET_OP_GE_JUMP_IF_FALSE,
+		[OP_INCREMENT_LOCAL] = &&TARGET_OP_INCREMENT_LOCAL,
+		[OP_ADD_NUM_NUM] = &&TARGET_OP_ADD_NUM_NUM,
+		[OP_ADD_STR_STR] = &&TARGET_OP_ADD_STR_STR,
+		[OP_SUBTRACT_NUM_NUM] = &&TARGET_OP_SUBTRACT_NUM_NUM,
+		[OP_MULTIPLY_NUM_NUM] = &&TARGET_OP_MULTIPLY_NUM_NUM,
+		[OP_DIVIDE_NUM_NUM] = &&TARGET_OP_DIVIDE_NUM_NUM,
+		[OP_GT_NUM_NUM] = &&TARGET_OP_GT_NUM_NUM,
+		[OP_LT_NUM_NUM] = &&TARGET_OP_LT_NUM_NUM,
+		[OP_LE_NUM_NUM] = &&TARGET_OP_LE_NUM_NUM,
+		[OP_GE_NUM_NUM] = &&TARGET_OP_GE_NUM_NUM,
+	};
+
+	#define CASE(opcode) TARGET_##opcode
+	#define DISPATCH() \
+			do { \
+				TRACE_INSTRUCTION(); \
+				goto *dispatchTable[READ_BYTE()]; \
+			} while (false)
+	#define NEXT DISPATCH()
+	#else
+	#define CASE(opcode) case opcode
+	#define NEXT break
+	#endif
+
+	LOAD_STATE();
+
 	Value value;
+	#ifdef COMPUTED_GOTO
+	DISPATCH();
+	#else
 	while (BYTES_LEFT_TO_EXECUTE()){
-		
-		#ifdef DEBUG_TRACE_EXECUTION
-			disassembleVMStack();
-			disassembleInstruction(frame->closure->function->chunk, (int) ((frame->ip) - (frame->closure->function->chunk->code)));
-		#endif
+
+		TRACE_INSTRUCTION();
 
 		uint8_t byte = READ_BYTE();
 		switch (byte){
-			case OP_RETURN:
+	#endif
+			CASE(OP_RETURN):
 				{
-					Value returnValue = pop();
+					Value returnValue = POP();
 
 					// Handle any open upvalues that need to be closed
-					closeObjUpvalues();
+					closeObjUpvalues(stackStart, stackpointer);
 
-					vm.stackpointer = frame->stackStart;
+					stackpointer = stackStart;
 					// no need to push the `nil` value for the main function
 					if (vm.frameCount > 1){
-						push(returnValue);
-						frame = &vm.frames[(--vm.frameCount) - 1];
-					} else return NO_ERROR;
+						PUSH(returnValue);
+						vm.frameCount--;
+						vm.stackpointer = stackpointer;
+						LOAD_STATE();
+						SAFEPOINT();
+					} else {
+						vm.stackpointer = stackpointer;
+						return NO_ERROR;
+					}
 				}
-				break;
+				NEXT;
 
-			case OP_PRINT:
-				printValue(pop());
+			CASE(OP_PRINT):
+				printValue(POP());
 				printf("\n");
-				break;
+				NEXT;
 
-			case OP_POP:
-				pop();
-				break;
+			CASE(OP_POP):
+				DROP();
+				NEXT;
 
-			case OP_POP_UPVALUE:
-				closeObjUpvalue((vm.stackpointer - 1) - vm.stack);
-				pop();
-				break;
+			CASE(OP_POP_UPVALUE):
+				closeObjUpvalue((stackpointer - 1) - vm.stack);
+				DROP();
+				NEXT;
 
-			case OP_CONSTANT:
+			CASE(OP_CONSTANT):
 				value = READ_CONSTANT();
-				push(value);
-				break;
+				PUSH(value);
+				NEXT;
 
-			case OP_TRUE:
-				push(BOOLEAN(true)); break;
+			CASE(OP_TRUE):
+				PUSH(BOOLEAN(true)); NEXT;
 
-			case OP_FALSE:
-				push(BOOLEAN(false)); break;
+			CASE(OP_FALSE):
+				PUSH(BOOLEAN(false)); NEXT;
 
-			case OP_NIL:
-				push(NIL); break;
+			CASE(OP_NIL):
+				PUSH(NIL); NEXT;
 
-			case OP_NEGATE:
-				if (!(IS_NUM(peek(0)))){
-					runtimeError("Operand must be a number");
-					return RUNTIME_ERROR;
+			CASE(OP_NEGATE):
+				if (!(IS_NUM(PEEK(0)))){
+					RAISE_RUNTIME_ERROR("Operand must be a number");
 				} else{
-					push(NUMBER(-AS_NUM(pop())));
+					PUSH(NUMBER(-AS_NUM(POP())));
 				}
-				break;
+				NEXT;
 
-			case OP_NOT:
-				push(BOOLEAN(!trueOrFalse(pop())));
-				break;
+			CASE(OP_NOT):
+				PUSH(BOOLEAN(!trueOrFalse(POP())));
+				NEXT;
 
-			case OP_ADD:
-				BINARY_OP(NUMBER, +, OP_ADD);
-				break;
+			CASE(OP_ADD):
+				BINARY_OP(NUMBER, +, OP_ADD, OP_ADD_NUM_NUM);
+				NEXT;
 			
-			case OP_SUBTRACT:
-				BINARY_OP(NUMBER, -, OP_SUBTRACT);
-				break;
+			CASE(OP_SUBTRACT):
+				BINARY_OP(NUMBER, -, OP_SUBTRACT, OP_SUBTRACT_NUM_NUM);
+				NEXT;
 
-			case OP_MULTIPLY:
-				BINARY_OP(NUMBER, *, OP_MULTIPLY);
-				break;
+			CASE(OP_MULTIPLY):
+				BINARY_OP(NUMBER, *, OP_MULTIPLY, OP_MULTIPLY_NUM_NUM);
+				NEXT;
 
-			case OP_DIVIDE:
-				BINARY_OP(NUMBER, /, OP_DIVIDE);
-				break;
+			CASE(OP_DIVIDE):
+				BINARY_OP(NUMBER, /, OP_DIVIDE, OP_DIVIDE_NUM_NUM);
+				NEXT;
 
-			case OP_GT:
-				BINARY_OP(BOOLEAN, >, OP_GT);
-				break;
+			CASE(OP_GT):
+				BINARY_OP(BOOLEAN, >, OP_GT, OP_GT_NUM_NUM);
+				NEXT;
 
-			case OP_LT:
-				BINARY_OP(BOOLEAN, <, OP_LT);
-				break;
+			CASE(OP_LT):
+				BINARY_OP(BOOLEAN, <, OP_LT, OP_LT_NUM_NUM);
+				NEXT;
 
-			case OP_EQUAL:
-				push(BOOLEAN(checkIfValuesEqual(pop(), pop())));
-				break;
-
-			case OP_DEFINE_GLOBAL:
+			CASE(OP_EQUAL):
 				{
-					value = READ_CONSTANT();
-					ObjectString* objString = AS_STRING_OBJ(value);
-					tableAdd(&vm.globals, objString, pop());
+					Value b = POP();
+					Value a = POP();
+					PUSH(BOOLEAN(checkIfValuesEqual(a, b)));
 				}
-				break;
+				NEXT;
 
-			case OP_GET_GLOBAL:
+			CASE(OP_NOT_EQUAL):
 				{
-					value = READ_CONSTANT();
-					ObjectString* objString = AS_STRING_OBJ(value);
-					if (tableHas(&vm.globals, objString)){
-						push(tableGet(&vm.globals, objString));
+					Value b = POP();
+					Value a = POP();
+					PUSH(BOOLEAN(!checkIfValuesEqual(a, b)));
+				}
+				NEXT;
 
-					} else {
-						runtimeError("Undefined variable '%s'", objString->string) ;
-						return RUNTIME_ERROR;
+			CASE(OP_LE):
+				BINARY_OP(NOT_BOOLEAN, >, OP_LE, OP_LE_NUM_NUM);
+				NEXT;
+
+			CASE(OP_GE):
+				BINARY_OP(NOT_BOOLEAN, <, OP_GE, OP_GE_NUM_NUM);
+				NEXT;
+
+			CASE(OP_DEFINE_GLOBAL_SLOT):
+				vm.globalValues.values[READ_SHORT()] = POP();
+				NEXT;
+
+			CASE(OP_GET_GLOBAL_SLOT):
+				{
+					uint16_t slot = READ_SHORT();
+					value = vm.globalValues.values[slot];
+					if (IS_UNDEFINED(value)){
+						RAISE_RUNTIME_ERROR("Undefined variable '%s'", AS_STRING_OBJ(vm.globalNames.values[slot])->string);
 					}
+					PUSH(value);
 				}
-				break;
+				NEXT;
 
-			case OP_GET_LOCAL:
+			CASE(OP_GET_LOCAL):
 				{
 					uint8_t index = READ_BYTE();
-					push(*(frame->stackStart + index));
+					PUSH(*(stackStart + index));
 				}
-				break;
+				NEXT;
 
-			case OP_SET_LOCAL:
+			CASE(OP_SET_LOCAL):
 				{
 					uint8_t index = READ_BYTE();
-					*(frame->stackStart + index) = peek(0);
+					*(stackStart + index) = PEEK(0);
 				}
-				break;
+				NEXT;
 
-			case OP_SET_GLOBAL:
+			CASE(OP_SET_GLOBAL_SLOT):
 				{
-					value = READ_CONSTANT();
-					ObjectString* objString = AS_STRING_OBJ(value);
-					if (tableHas(&vm.globals, objString)){
-						tableAdd(&vm.globals, objString, peek(0));
-					} else {
-						runtimeError("Undefined variable '%s'", objString->string) ;
-						return RUNTIME_ERROR;
+					uint16_t slot = READ_SHORT();
+					if (IS_UNDEFINED(vm.globalValues.values[slot])){
+						RAISE_RUNTIME_ERROR("Undefined variable '%s'", AS_STRING_OBJ(vm.globalNames.values[slot])->string);
 					}
+					vm.globalValues.values[slot] = PEEK(0);
 				}
-				break;
+				NEXT;
 
-			case OP_JUMP_IF_FALSE:
+			CASE(OP_JUMP_IF_FALSE):
 				{
 					uint16_t offset = READ_2BYTES();
-					mutate_vm_ip(OP_JUMP_IF_FALSE, offset);
+					ip += (trueOrFalse(PEEK(0))) ? 2 : offset;
 				}
-				break;
+				NEXT;
 
-			case OP_JUMP_IF_TRUE:
+			CASE(OP_JUMP_IF_TRUE):
 				{
 					uint16_t offset = READ_2BYTES();
-					mutate_vm_ip(OP_JUMP_IF_TRUE, offset);
+					ip += (trueOrFalse(PEEK(0))) ? offset : 2;
 				}
-				break;
+				NEXT;
 
-			case OP_JUMP:
+			CASE(OP_POP_JUMP_IF_FALSE):
 				{
 					uint16_t offset = READ_2BYTES();
-					mutate_vm_ip(OP_JUMP, offset);
+					ip += (trueOrFalse(POP())) ? 2 : offset;
 				}
-				break;
+				NEXT;
 
-			case OP_LOOP:
+			CASE(OP_EQUAL_JUMP_IF_FALSE):
 				{
 					uint16_t offset = READ_2BYTES();
-					mutate_vm_ip(OP_LOOP, offset);
+					Value b = POP();
+					Value a = POP();
+					ip += (checkIfValuesEqual(a, b)) ? 2 : offset;
 				}
-				break;
+				NEXT;
+
+			CASE(OP_NOT_EQUAL_JUMP_IF_FALSE):
+				{
+					uint16_t offset = READ_2BYTES();
+					Value b = POP();
+					Value a = POP();
+					ip += (checkIfValuesEqual(a, b)) ? offset : 2;
+				}
+				NEXT;
+
+			CASE(OP_LT_JUMP_IF_FALSE):
+				COMPARE_AND_JUMP(<, false);
+				NEXT;
+
+			CASE(OP_LE_JUMP_IF_FALSE):
+				// Jumps if `!(a > b)` is false
+				COMPARE_AND_JUMP(>, true);
+				NEXT;
+
+			CASE(OP_GT_JUMP_IF_FALSE):
+				COMPARE_AND_JUMP(>, false);
+				NEXT;
+
+			CASE(OP_GE_JUMP_IF_FALSE):
+				// Jumps if `!(a < b)` is false
+				COMPARE_AND_JUMP(<, true);
+				NEXT;
+
+			CASE(OP_JUMP):
+				{
+					uint16_t offset = READ_2BYTES();
+					ip += offset;
+				}
+				NEXT;
 
-			case OP_GET_UPVALUE:
+			CASE(OP_LOOP):
+				{
+					uint16_t offset = READ_2BYTES();
+					ip -= offset;
+					SAFEPOINT();
+				}
+				NEXT;
+
+			// local = local + constant, without pushing anything on the stack
+			CASE(OP_INCREMENT_LOCAL):
+				{
+					Value* local = stackStart + READ_BYTE();
+					Value increment = READ_CONSTANT();
+
+					if (IS_NUM(*local) && IS_NUM(increment)){
+						*local = NUMBER(AS_NUM(*local) + AS_NUM(increment));
+					} else if (IS_STRING_OR_ROPE(*local) && IS_STRING(increment)){
+						PUSH(*local);
+						PUSH(increment);
+						SAVE_STATE();
+						Object* result = concatenate();
+						stackpointer = vm.stackpointer;
+						*local = OBJECT(result);
+					} else {
+						RAISE_RUNTIME_ERROR("Operands must be two numbers or two strings");
+					}
+				}
+				NEXT;
+
+			CASE(OP_ADD_NUM_NUM):
+				NUM_NUM_OP(NUMBER, +, OP_ADD);
+				NEXT;
+
+			CASE(OP_ADD_STR_STR):
+				if (!(IS_STRING_OR_ROPE(PEEK(0)) && IS_STRING_OR_ROPE(PEEK(1)))) DEQUICKEN(OP_ADD);
+				{
+					SAVE_STATE();
+					Object* result = concatenate();
+					stackpointer = vm.stackpointer;
+					PUSH(OBJECT(result));
+				}
+				NEXT;
+
+			CASE(OP_SUBTRACT_NUM_NUM):
+				NUM_NUM_OP(NUMBER, -, OP_SUBTRACT);
+				NEXT;
+
+			CASE(OP_MULTIPLY_NUM_NUM):
+				NUM_NUM_OP(NUMBER, *, OP_MULTIPLY);
+				NEXT;
+
+			CASE(OP_DIVIDE_NUM_NUM):
+				NUM_NUM_OP(NUMBER, /, OP_DIVIDE);
+				NEXT;
+
+			CASE(OP_GT_NUM_NUM):
+				NUM_NUM_OP(BOOLEAN, >, OP_GT);
+				NEXT;
+
+			CASE(OP_LT_NUM_NUM):
+				NUM_NUM_OP(BOOLEAN, <, OP_LT);
+				NEXT;
+
+			CASE(OP_LE_NUM_NUM):
+				NUM_NUM_OP(NOT_BOOLEAN, >, OP_LE);
+				NEXT;
+
+			CASE(OP_GE_NUM_NUM):
+				NUM_NUM_OP(NOT_BOOLEAN, <, OP_GE);
+				NEXT;
+
+			CASE(OP_GET_UPVALUE):
 				{
 					int index = READ_BYTE();
 					ObjectUpvalue* objUpvalue = *(frame->closure->objUpvalues + index);
-					push(*(objUpvalue->value));
+					PUSH(*(objUpvalue->value));
 				}
-				break;
+				NEXT;
 
-			case OP_SET_UPVALUE:
+			CASE(OP_SET_UPVALUE):
 				{
 					int index = READ_BYTE();
 					ObjectUpvalue* objUpvalue = *(frame->closure->objUpvalues + index);
-					*(objUpvalue->value) = peek(0);
+					*(objUpvalue->value) = PEEK(0);
+					writeBarrier((Object*) objUpvalue, PEEK(0));
 				}
-				break;
+				NEXT;
 
-			case OP_CLOSURE:
+			CASE(OP_CLOSURE):
 				{
 					ObjectFunction* function = AS_FUNCTION_OBJ(READ_CONSTANT());
+					SAVE_STATE();
 					ObjectClosure* closure = makeNewFunctionClosureObject(function);
-					push(OBJECT(closure));
+					PUSH(OBJECT(closure));
+					// the closure needs to be reachable while the upvalue objects get allocated
+					vm.stackpointer = stackpointer;
 
 					for (int i=0; i<function->upvaluesCount; i++){
 						uint8_t instruction = READ_BYTE();
 						uint8_t index = READ_BYTE();
 						if (instruction == OP_CLOSE_LOCAL){
-							closure->objUpvalues[i] = makeNewUpvalueObject((frame->stackStart+index) - vm.stack);
-							closure->objUpvalues[i]->value = (frame->stackStart + index);
+							closure->objUpvalues[i] = makeNewUpvalueObject((stackStart+index) - vm.stack);
+							closure->objUpvalues[i]->value = (stackStart + index);
 						} else {
 							closure->objUpvalues[i] = frame->closure->objUpvalues[index];
 						}
+						// The gc can run while the upvalue objects get allocated, so the closure is not necessarily new (white) anymore
+						writeBarrier((Object*) closure, OBJECT(closure->objUpvalues[i]));
 
 					}
 				}
-				break;
+				NEXT;
 
-			case OP_CALL:
+			CASE(OP_CALL):
 				{
 					uint8_t nargs = READ_BYTE();
-					Value funcVal = peek(nargs);
+					Value funcVal = PEEK(nargs);
 
+					// Closures skip call() and its second dispatch on the object type in callNoErrors()
+					if (IS_CLOSURE(funcVal)){
+						CALL_METHOD(AS_CLOSURE_OBJ(funcVal), nargs);
+						NEXT;
+					}
+					SAVE_STATE();
 					if (!call(funcVal, nargs, &frame)) return RUNTIME_ERROR;
+					LOAD_STATE();
 				}
-				break;
+				NEXT;
 
-			case OP_CLASS:
+			CASE(OP_CLASS):
 				{
 					ObjectString* name = AS_STRING_OBJ(READ_CONSTANT());
-					push(OBJECT(makeClassObject(name)));
+					SAVE_STATE();
+					PUSH(OBJECT(makeClassObject(name)));
 				}
-				break;
+				NEXT;
 
-			case OP_METHOD:
+			CASE(OP_METHOD):
 				{
 					// closure object will be on top of the stack 
 					// the class object should be right below it
-					ObjectClosure* closure = AS_CLOSURE_OBJ(peek(0));
-					ObjectClass* class = AS_CLASS_OBJ(peek(1));
+					ObjectClosure* closure = AS_CLOSURE_OBJ(PEEK(0));
+					ObjectClass* class = AS_CLASS_OBJ(PEEK(1));
 
-					tableAdd(class->methods, closure->function->name, peek(0));
+					SAVE_STATE();
+					setMethod(class, closure->function->name, closure);
+					class->version++;
 					// pop closure object from stack 
-					pop();
+					DROP();
 				}
-				break;
+				NEXT;
 
-			case OP_GET_PROPERTY:
+			CASE(OP_GET_PROPERTY):
 				{
 					ObjectString* property = AS_STRING_OBJ(READ_CONSTANT());
-					Value instanceValue = peek(0);
+					InlineCache* cache = READ_CACHE();
+					Value instanceValue = PEEK(0);
 
 					if (IS_INSTANCE(instanceValue)){
 						ObjectInstance* instance = AS_INSTANCE_OBJ(instanceValue);
-						if (tableHas(instance->fields, property)){
-							// pop instance object
-							pop();
-							// push instance property value
-							push(tableGet(instance->fields, property));
+
+						if (IS_CACHED_FIELD(cache, instance)){
+							// replace instance object with the property value
+							PEEK(0) = instance->fields[cache->slot];
+
+						} else if (IS_CACHED_METHOD(cache, instance->Class)){
+							SAVE_STATE();
+							PEEK(0) = OBJECT(makeBoundMethodObject(cache->method, instance));
+
+						} else if (lookupField(cache, instance, property, &value)){
+							PEEK(0) = value;
+
 						} else{
-							ObjectClass* class = instance->Class;
-							if (findAndBindMethod(instance, class, property) == RUNTIME_ERROR) return RUNTIME_ERROR;
+							ObjectClosure* method = findMethod(instance->Class, property);
+							if (method == NULL) RAISE_RUNTIME_ERROR("Undefined property %s", property->string);
+
+							cacheMethod(cache, instance->Class, method);
+							SAVE_STATE();
+							PEEK(0) = OBJECT(makeBoundMethodObject(method, instance));
 						}
 
 					} else{
-						runtimeError("Cannot access properties of a non-instance");
-						return RUNTIME_ERROR;
+						RAISE_RUNTIME_ERROR("Cannot access properties of a non-instance");
 					}
 				}
-				break;
+				NEXT;
 
-			case OP_SET_PROPERTY:
+			CASE(OP_SET_PROPERTY):
 				{
 					ObjectString* property = AS_STRING_OBJ(READ_CONSTANT());
-					Value instanceValue = peek(1);
+					InlineCache* cache = READ_CACHE();
+					Value instanceValue = PEEK(1);
 
 					if (IS_INSTANCE(instanceValue)){
 						ObjectInstance* instance = AS_INSTANCE_OBJ(instanceValue);
-						tableAdd(instance->fields, property, peek(0));
+
+						if (IS_CACHED_STORE(cache, instance)){
+							instance->fields[cache->slot] = PEEK(0);
+							instance->shape = cache->newShape;
+							writeBarrier((Object*) instance, PEEK(0));
+						} else{
+							SAVE_STATE();
+							storeField(cache, instance, property, PEEK(0));
+						}
 
 						// pop expression value to set
-						Value expression = pop();
-						// pop instance object
-						pop();
-						// push instance property value
-						push(expression);
+						Value expression = POP();
+						// replace instance object with the property value
+						PEEK(0) = expression;
 					} else{
-						runtimeError("Can only set fields of instance objects");
-						return RUNTIME_ERROR;
+						RAISE_RUNTIME_ERROR("Can only set fields of instance objects");
 					}
 
 				}
-				break;
+				NEXT;
 
-			case OP_FAST_METHOD_CALL:
+			CASE(OP_FAST_METHOD_CALL):
 				{
 					// The stack will have the arguments on the top
 					// below them should be the instance object
 					ObjectString* methodName = (AS_STRING_OBJ(READ_CONSTANT()));
 					uint8_t nargs = READ_BYTE();
-					Value instance = peek(nargs);
+					InlineCache* cache = READ_CACHE();
+					Value instance = PEEK(nargs);
+					ObjectClosure* method;
 
-					if (instance.type != TYPE_OBJ || (AS_OBJ(instance))->objectType != OBJECT_INSTANCE){
-						runtimeError("Cannot access properties of a non-instance");
-						return RUNTIME_ERROR;
+					if (!(IS_INSTANCE(instance))){
+						RAISE_RUNTIME_ERROR("Cannot access properties of a non-instance");
 					}else{
 						ObjectInstance* instanceObj = AS_INSTANCE_OBJ(instance);
 
-						// Fields take priority first
-						if (tableHas(instanceObj->fields, methodName)){
-							Value value = tableGet(instanceObj->fields, methodName);
-							*(vm.stackpointer - nargs - 1) = value;
+						if (IS_CACHED_METHOD(cache, instanceObj->Class)){
+							CALL_METHOD(cache->method, nargs);
+
+						// Fields take priority over methods
+						} else if (lookupField(cache, instanceObj, methodName, &value)){
+							PEEK(nargs) = value;
 
+							SAVE_STATE();
 							if (!call(value, nargs, &frame)) return RUNTIME_ERROR;
+							LOAD_STATE();
 
 						// Methods if there is no such field with that name
-						} else if (tableHas(instanceObj->Class->methods, methodName)){
-							ObjectClosure* objClosure = AS_CLOSURE_OBJ(tableGet(instanceObj->Class->methods, methodName));
-							setupFrameForClosureCall(objClosure, &frame, nargs);
+						} else if ((method = findMethod(instanceObj->Class, methodName)) != NULL){
+							cacheMethod(cache, instanceObj->Class, method);
+							CALL_METHOD(method, nargs);
 						} else {
 
-							runtimeError("Undefined property %s for instance", methodName->string);
-							return RUNTIME_ERROR;
+							RAISE_RUNTIME_ERROR("Undefined property %s for instance", methodName->string);
 						}
 					}
 				}
-				break;
+				NEXT;
 
-			case OP_INHERIT_SUPERCLASS:
+			CASE(OP_INHERIT_SUPERCLASS):
 				{
-					Value superclassValue = peek(0);
+					Value superclassValue = PEEK(0);
 					if (!(IS_CLASS(superclassValue))){
-						runtimeError("Cannot inherit since the superclass it is not of type class");
-						return RUNTIME_ERROR;
+						RAISE_RUNTIME_ERROR("Cannot inherit since the superclass it is not of type class");
 					}
 
 					ObjectClass* superclass = AS_CLASS_OBJ(superclassValue);
-					ObjectClass* class_ = AS_CLASS_OBJ(peek(1));
+					ObjectClass* class_ = AS_CLASS_OBJ(PEEK(1));
 
-					for (int i=0; i < superclass->methods->capacity; i++){
-						Entry entry = superclass->methods->entries[i];
-						if (entry.key != NULL){
-							tableAdd(class_->methods, entry.key, entry.value);
-						}
-					}
+					SAVE_STATE();
+					inheritMethods(class_, superclass);
+					class_->version++;
 				}
-				break;
+				NEXT;
 			// swap superclass and class value on stack
-			case OP_STACK_SWAP:
+			CASE(OP_STACK_SWAP):
 				{
-					Value superclass = pop();
-					push(peek(0));
-					*(vm.stackpointer - 2) = superclass;
+					Value superclass = POP();
+					PUSH(PEEK(0));
+					*(stackpointer - 2) = superclass;
 				}
-				break;
+				NEXT;
 
-			case OP_GET_SUPER:
+			CASE(OP_GET_SUPER):
 				{
 					Value methodName = READ_CONSTANT();
-					ObjectInstance* instance = AS_INSTANCE_OBJ((*(frame->stackStart)));
-					if (findAndBindMethod(instance, AS_CLASS_OBJ(peek(0)), AS_STRING_OBJ(methodName)) == RUNTIME_ERROR) return RUNTIME_ERROR;
+					ObjectInstance* instance = AS_INSTANCE_OBJ((*stackStart));
+					SAVE_STATE();
+					if (findAndBindMethod(instance, AS_CLASS_OBJ(PEEK(0)), AS_STRING_OBJ(methodName)) == RUNTIME_ERROR) return RUNTIME_ERROR;
+					stackpointer = vm.stackpointer;
 				}
-				break;
+				NEXT;
 
-			case OP_FAST_SUPER_METHOD_CALL:
+			CASE(OP_FAST_SUPER_METHOD_CALL):
 				{
 					// The stack will have the arguments on the top
 					// below them should be the superclass object
 					// instance `this` will be on start of call frame stack pointer
 					ObjectString* methodName = (AS_STRING_OBJ(READ_CONSTANT()));
 					uint8_t nargs = READ_BYTE();
-					ObjectClass* superclass = AS_CLASS_OBJ(peek(nargs));
+					ObjectClass* superclass = AS_CLASS_OBJ(PEEK(nargs));
 
-					if (tableHas(superclass->methods, methodName)){
+					ObjectClosure* objClosure = findMethod(superclass, methodName);
 
-						Value closureVal = tableGet(superclass->methods, methodName);
-						ObjectClosure* objClosure = AS_CLOSURE_OBJ(closureVal);
+					if (objClosure != NULL){
 
-						if (callNoErrors(nargs, closureVal))
-						{
-							// Change the superclass object with the instance
-							*(vm.stackpointer - nargs - 1) = *(frame->stackStart);
-							setupFrameForClosureCall(objClosure, &frame, nargs);
-						}
+						SAVE_STATE();
+						if (!callNoErrors(nargs, OBJECT(objClosure))) return RUNTIME_ERROR;
+
+						// Change the superclass object with the instance
+						*(stackpointer - nargs - 1) = *stackStart;
+						setupFrameForClosureCall(objClosure, &frame, nargs);
+						LOAD_STATE();
 
 					} else {
 
-						runtimeError("Undefined property %s for instance", methodName->string);
-						return RUNTIME_ERROR;
+						RAISE_RUNTIME_ERROR("Undefined property %s for instance", methodName->string);
 					}
 				}
-				break;
+				NEXT;
 
+	#ifdef COMPUTED_GOTO
+			UNKNOWN_OPCODE:
+	#else
 			default:
+	#endif
 				return COMPILE_ERROR;
+	#ifndef COMPUTED_GOTO
 		}
 	}
+	SAVE_STATE();
 	return NO_ERROR;
+	#endif
 
-	#undef BINARY_OPERATION
+	#undef SAVE_STATE
+	#undef LOAD_STATE
+	#undef PUSH
+	#undef POP
+	#undef DROP
+	#undef PEEK
+	#undef RAISE_RUNTIME_ERROR
+	#undef NOT_BOOLEAN
+	#undef BINARY_OP
+	#undef IS_CACHED_FIELD
+	#undef IS_CACHED_STORE
+	#undef IS_CACHED_METHOD
+	#undef CALL_METHOD
+	#undef DEQUICKEN
+	#undef NUM_NUM_OP
+	#undef COMPARE_AND_JUMP
+	#undef SAFEPOINT
 	#undef READ_BYTE
 	#undef READ_2BYTES
+	#undef READ_SHORT
+	#undef READ_CACHE
 	#undef READ_CONSTANT
 	#undef BYTES_LEFT_TO_EXECUTE
+	#undef TRACE_INSTRUCTION
+	#undef CASE
+	#undef DISPATCH
+	#undef NEXT
 }
 
 void freeVM(){
@@ -497,17 +917,29 @@ void freeVM(){
 	runGarbageCollector();
 	#endif
 
+	#ifdef DEBUG_SLAB_STATS
+	printSlabStats();
+	#endif
+
 	freeObjects();
+	#ifdef GENERATIONAL_GC
+	freeNursery();
+	#endif
+	resetGC();
+	freeProfiler();
 	freeTable(&vm.strings);
-	freeTable(&vm.globals);
+	freeTable(&vm.globalSlots);
+	freeValueArray(&vm.globalValues);
+	freeValueArray(&vm.globalNames);
+	freeValueArray(&vm.selectorNames);
 	initVM(true);
 }
 
 // Helper functions
 int findAndBindMethod(ObjectInstance* instance, ObjectClass* class, ObjectString* property){
-	if (tableHas(class->methods, property)){
+	ObjectClosure* closure = findMethod(class, property);
+	if (closure != NULL){
 		// Create a bound method to capture the `instance` which is on the stack and bind the closure object with it
-		ObjectClosure* closure= AS_CLOSURE_OBJ(tableGet(class->methods, property));
 		ObjectBoundMethod* boundMethod = makeBoundMethodObject(closure, instance);
 
 		// pop instance or superclass object
@@ -520,54 +952,102 @@ int findAndBindMethod(ObjectInstance* instance, ObjectClass* class, ObjectString
 	return NO_ERROR;
 }
 
-bool trueOrFalse(Value val){
-	if (val.type == TYPE_NUM) return true;
-	else if (val.type == TYPE_OBJ) return true;
-	else if (val.type == TYPE_BOOL) return AS_BOOL(val);
-	return false;
+// Returns the global slot for `name`, adding a new undefined slot the first time a name is seen
+int getGlobalSlot(ObjectString* name){
+	if (tableHas(&vm.globalSlots, name)) return (int) AS_NUM(tableGet(&vm.globalSlots, name));
+
+	// Push in the off chance the gc runs while the arrays grow
+	push(OBJECT(name));
+	int slot = vm.globalValues.count;
+	appendValue(&vm.globalNames, OBJECT(name));
+	appendValue(&vm.globalValues, UNDEFINED);
+	tableAdd(&vm.globalSlots, name, NUMBER(slot));
+	pop();
+	return slot;
 }
 
-Object* concatenate(){
-	// Peek just in case the gc runs and we lose these two string objects
-	ObjectString* b = AS_STRING_OBJ(peek(0));
-	ObjectString* a = AS_STRING_OBJ(peek(1));
+// Returns the selector (vtable index) for a method name, assigning the next one the first time a name is seen
+int getSelector(ObjectString* name){
+	if (name->selector < 0){
+		appendValue(&vm.selectorNames, OBJECT(name));
+		name->selector = vm.selectorNames.count - 1;
+	}
+	return name->selector;
+}
 
-	int length = b->length+a->length;
-	char* string = (char*) reallocate(NULL, 0, length);
-	memcpy(string, a->string, a->length);
-	memcpy(string+a->length, b->string, b->length);
+// Inline caches hold references to classes and methods, and are only filled by the function that is running
+// so that function is the one remembered when they get young objects
+static void cacheWriteBarrier(ObjectClass* class, ObjectClosure* method){
+	#if defined(GENERATIONAL_GC) || defined(INCREMENTAL_GC)
+	ObjectFunction* function = vm.frames[vm.frameCount - 1].closure->function;
+	WRITE_BARRIER(function, OBJECT(class));
+	if (method != NULL) WRITE_BARRIER(function, OBJECT(method));
+	#endif
+}
 
-	ObjectString* ptr = makeStringObject(string, length);
+// Looks up a field, and remembers the shape and slot it was found in in the inline cache
+bool lookupField(InlineCache* cache, ObjectInstance* instance, ObjectString* property, Value* value){
+	if (IS_DICTIONARY_MODE(instance)) return getInstanceField(instance, property, value);
 
-	reallocate(string, length, 0);
+	if (cache->shape != instance->shape){
+		int slot = shapeFindSlot(instance->shape, property);
+		if (slot == -1) return false;
 
-	// Pop afterwards because we no longer need them
-	pop();
-	pop();
+		cache->shape = instance->shape;
+		cache->newShape = instance->shape;
+		cache->slot = slot;
+		cacheWriteBarrier(instance->Class, NULL);
+	}
+	*value = instance->fields[cache->slot];
+	return true;
+}
 
-	return (Object*) ptr;
+// Remembers the method the class resolved a property to in the inline cache
+// Nothing is cached when an instance has a field shadowing one of the methods
+void cacheMethod(InlineCache* cache, ObjectClass* class, ObjectClosure* method){
+	if (class->fieldShadowsMethod) return;
+
+	cache->Class = class;
+	cache->classVersion = class->version;
+	cache->method = method;
+	cacheWriteBarrier(class, method);
 }
 
-void mutate_vm_ip(uint8_t opcode, uint16_t offset){
-	CallFrame* frame = &vm.frames[vm.frameCount-1];
-	bool mutate = (opcode == OP_JUMP_IF_FALSE && (trueOrFalse(peek(0)) == false)) ||
-			(opcode == OP_JUMP_IF_TRUE && (trueOrFalse(peek(0)) == true));
+// Sets a field, and remembers the shape transition it took in the inline cache
+void storeField(InlineCache* cache, ObjectInstance* instance, ObjectString* property, Value value){
+	ObjectClass* class = instance->Class;
 
-	switch(opcode){
-		case OP_JUMP_IF_TRUE:
-		case OP_JUMP_IF_FALSE:
-			if (!mutate){
-				frame->ip += 2;
-				return;
-			}
-		case OP_JUMP:
-			frame->ip += offset;
-			break;
-		case OP_LOOP:
-			frame->ip -= offset;
-			break;
+	// A new field with the name of a method invalidates every method cached for the class
+	if (!class->fieldShadowsMethod && findMethod(class, property) != NULL && !instanceHasField(instance, property)){
+		class->fieldShadowsMethod = true;
+		class->version++;
 	}
 
+	Shape* shape = instance->shape;
+	setInstanceField(instance, property, value);
+
+	if (!IS_DICTIONARY_MODE(instance)){
+		cache->shape = shape;
+		cache->newShape = instance->shape;
+		cache->slot = shapeFindSlot(instance->shape, property);
+		cacheWriteBarrier(class, NULL);
+	}
+}
+
+bool trueOrFalse(Value val){
+	// Only `nil` and `false` are falsey
+	return !(IS_NIL(val) || (IS_BOOL(val) && !AS_BOOL(val)));
+}
+
+Object* concatenate(){
+	// Peek just in case the gc runs and we lose these two string objects
+	Object* result = makeConcatenation(AS_OBJ(peek(1)), AS_OBJ(peek(0)));
+
+	// Pop afterwards because we no longer need them
+	pop();
+	pop();
+
+	return result;
 }
 
 void closeObjUpvalue(int index){
@@ -575,23 +1055,23 @@ void closeObjUpvalue(int index){
 		ObjectUpvalue* upvalue = vm.openObjUpvalues[index];
 
 		upvalue->closedValue = *(upvalue->value);
+		// No write barrier needed: old upvalues stay in the remembered set for as long as they are open
 		upvalue->value = &upvalue->closedValue;
 
 		vm.openObjUpvalues[index] = NULL;
 	}
 }
 
-void closeObjUpvalues(){
+void closeObjUpvalues(Value* stackStart, Value* stackpointer){
 	// This function is called during OP_RETURN execution
 	// since the OP_POP_UPVALUE instruction won't execute during function returns since
 	// the stackpointer is mutated instead, we will need to emulate as if we are running OP_POP_UPVALUE instructions
 	// The idea is just to go through the vm.openObjUpalues array from the frame's starting stack index till the current stackpointer and close the open upvalue if its applicable
 	
-	Value* currentStackSlot = vm.stackpointer - 1;
-	Value* stackStartForFrame = (vm.frames[vm.frameCount-1]).stackStart;
-	while (currentStackSlot >= stackStartForFrame){
+	Value* currentStackSlot = stackpointer - 1;
+	while (currentStackSlot >= stackStart){
 
-		closeObjUpvalue(currentStackSlot - stackStartForFrame);
+		closeObjUpvalue(currentStackSlot - vm.stack);
 		currentStackSlot--;
 	}
 }
@@ -626,7 +1106,7 @@ bool call(Value funcVal, int nargs, CallFrame** frame){
 				ObjectNativeFunction* nativeFn = AS_NATIVE_FUNCTION_OBJ(peek(nargs));
 				bool success = nativeFn->nativeFunction();
 				if (!success) {
-					return RUNTIME_ERROR;
+					return false;
 				} 
 				Value nativeValue = pop();
 				vm.stackpointer -= (nargs +1);
@@ -646,10 +1126,8 @@ bool call(Value funcVal, int nargs, CallFrame** frame){
 
 				// Call the init function if any
 				*(vm.stackpointer - 1 - nargs) = OBJECT(instance);
-				if (tableHas((AS_CLASS_OBJ(funcVal))->methods, vm.init)){
-					ObjectClosure* initClosure = AS_CLOSURE_OBJ(tableGet((AS_CLASS_OBJ(funcVal))->methods, vm.init));
-					setupFrameForClosureCall(initClosure, frame, nargs);
-				}
+				ObjectClosure* initClosure = AS_CLASS_OBJ(funcVal)->initializer;
+				if (initClosure != NULL) setupFrameForClosureCall(initClosure, frame, nargs);
 			}
 				break;
 			case OBJECT_BOUND_METHOD:
@@ -673,38 +1151,33 @@ bool call(Value funcVal, int nargs, CallFrame** frame){
 
 bool callNoErrors(int nargs, Value funcVal){
 	int arity;
-	switch (funcVal.type){
-		case TYPE_OBJ:
-		{
-			switch (AS_OBJ(funcVal)->objectType){
-				case OBJECT_NATIVE_FUNCTION:
-					arity = (AS_NATIVE_FUNCTION_OBJ(funcVal))->arity;
-				case OBJECT_BOUND_METHOD:
-					if (IS_BOUND_METHOD(funcVal)) arity = (AS_BOUND_METHOD_OBJ(funcVal))->closure->function->arity;
-				case OBJECT_CLOSURE:
-					if (IS_CLOSURE(funcVal)) arity = (AS_CLOSURE_OBJ(funcVal))->function->arity;
-				case OBJECT_CLASS:{
-					if (IS_CLASS(funcVal)){
-						ObjectClass* objClass = AS_CLASS_OBJ(funcVal);
-						if (tableHas(objClass->methods, vm.init)) arity = (AS_CLOSURE_OBJ(tableGet(objClass->methods, vm.init)))->function->arity;
-						else arity = 0;
-					}
+	if (IS_OBJ(funcVal)){
+		switch (AS_OBJ(funcVal)->objectType){
+			case OBJECT_NATIVE_FUNCTION:
+				arity = (AS_NATIVE_FUNCTION_OBJ(funcVal))->arity;
+			case OBJECT_BOUND_METHOD:
+				if (IS_BOUND_METHOD(funcVal)) arity = (AS_BOUND_METHOD_OBJ(funcVal))->closure->function->arity;
+			case OBJECT_CLOSURE:
+				if (IS_CLOSURE(funcVal)) arity = (AS_CLOSURE_OBJ(funcVal))->function->arity;
+			case OBJECT_CLASS:{
+				if (IS_CLASS(funcVal)){
+					ObjectClass* objClass = AS_CLASS_OBJ(funcVal);
+					if (objClass->initializer != NULL) arity = objClass->initializer->function->arity;
+					else arity = 0;
+				}
 
-					if (nargs != arity){
-						runtimeError("Expected %d arguments, got %d", arity, nargs);
-						return false;
-					}
-					if (vm.frameCount == CALL_FRAMES_MAX) {
-						runtimeError("Call stack overflow !!");
-						return false;
-					}}
-					return true;
-				default:
-					break;
-			}}
-			break;
-		default:
-			break;
+				if (nargs != arity){
+					runtimeError("Expected %d arguments, got %d", arity, nargs);
+					return false;
+				}
+				if (vm.frameCount == CALL_FRAMES_MAX) {
+					runtimeError("Call stack overflow !!");
+					return false;
+				}}
+				return true;
+			default:
+				break;
+		}
 	}
 	runtimeError("Can only call functions, methods and classes");
 	return false;
@@ -742,12 +1215,18 @@ void declareNativeFunctions(){
 	declareNativeFunction("clock", 0, clockNativeFunction);
 	declareNativeFunction("input", 0, inputNativeFunction);
 	declareNativeFunction("number", 1, numberNativeFunction);
+	declareNativeFunction("gcStats", 1, gcStatsNativeFunction);
+	declareNativeFunction("heapSnapshot", 1, heapSnapshotNativeFunction);
 }
 
 void declareNativeFunction(char name[], int arity, NativeFunction functionToExecute){
 	ObjectString* loxString = makeStringObject(name, strlen(name));
 	ObjectNativeFunction* nativeFn = makeNewNativeFunctionObject(loxString, arity, functionToExecute);
-	tableAdd(&vm.globals, loxString, OBJECT(nativeFn));
+
+	// Push in the off chance the gc runs while the global slot is added
+	push(OBJECT(nativeFn));
+	int slot = getGlobalSlot(loxString);
+	vm.globalValues.values[slot] = pop();
 }
 bool clockNativeFunction(){
 	push(NUMBER(clock()));
@@ -770,36 +1249,55 @@ bool inputNativeFunction(){
 	return true;
 }
 
+// gcStats("cycles") returns the number of gc cycles so far, see printGCStats for the names of the statistics
+bool gcStatsNativeFunction(){
+	Value name = peek(0);
+	double value;
+	if (!IS_STRING_OR_ROPE(name) || !getGCStat(flattenString(AS_OBJ(name))->string, &value)){
+		push(NIL);
+		runtimeError("Unknown gc statistic");
+		return false;
+	}
+	push(NUMBER(value));
+	return true;
+}
+
+// heapSnapshot("heap.txt") writes a snapshot of the heap to the file, returns whether it could
+bool heapSnapshotNativeFunction(){
+	Value path = peek(0);
+	if (!IS_STRING_OR_ROPE(path)){
+		push(NIL);
+		runtimeError("heapSnapshot() expects the path of a file");
+		return false;
+	}
+	push(BOOLEAN(writeHeapSnapshot(flattenString(AS_OBJ(path))->string)));
+	return true;
+}
+
 bool numberNativeFunction(){
-	switch(peek(0).type){
-		case TYPE_NUM:
-			push(peek(0));
-			break;
-		case TYPE_BOOL:
-			{
-				double val = 0;
-				if (peek(0).as.boolean == true) val = 1;
-				push(NUMBER(val));
-			}
-			break;
-		case TYPE_NIL:
+	Value value = peek(0);
+	if (IS_NUM(value)){
+		push(value);
+
+	} else if (IS_BOOL(value)){
+		double val = 0;
+		if (AS_BOOL(value) == true) val = 1;
+		push(NUMBER(val));
+
+	} else if (IS_NIL(value)){
+		push(NUMBER(0));
+
+	} else if (IS_OBJ(value)){
+		double num;
+		char* ptr;
+		if (!IS_STRING_OR_ROPE(value)){
 			push(NUMBER(0));
-			break;
-		case TYPE_OBJ:
-			{
-				double num;
-				char* ptr;
-				if ((AS_OBJ(peek(0)))->objectType != OBJECT_STRING){
-					push(NUMBER(0));
-					runtimeError("Cannot convert provided value type to number");
-					return false;
-				}
-				ObjectString* str = AS_STRING_OBJ(peek(0));
-				num = strtod(str->string, &ptr);
-				push(NUMBER(num));
-			}
-			break;
+			runtimeError("Cannot convert provided value type to number");
+			return false;
+		}
+		ObjectString* str = flattenString(AS_OBJ(value));
+		num = strtod(str->string, &ptr);
+		push(NUMBER(num));
 	}
 	return true;
 }
-
@@ -1,9 +1,14 @@
 #ifndef VM_H
 #define VM_H
 
+#include <setjmp.h>
+
 #include "chunk.h"
 #include "table.h"
 #include "gc.h"
+#include "nursery.h"
+#include "slab.h"
+#include "profiler.h"
 
 #define STACK_MAX_SIZE 256
 
@@ -27,16 +32,30 @@ typedef struct{
 	Value stack[STACK_MAX_SIZE];
 	ObjectUpvalue* openObjUpvalues[STACK_MAX_SIZE];
 
-	Object* objects;
+	// Old generation
+	Slab slab;
+	Nursery nursery;
 	Table strings;
-	Table globals;
+
+	// Global variables live in a dense array indexed by the slot the compiler resolved their name to
+	// Slots of globals that are not defined (yet) hold `UNDEFINED`
+	Table globalSlots;
+	ValueArray globalValues;
+	ValueArray globalNames;
 
 	ObjectString* init;
 
-	int bytesAllocated;
-	int nextGCRun;
+	// Method names, indexed by selector
+	ValueArray selectorNames;
+
+	// Bytes of the old generation and of what every object owns outside of itself (character arrays, chunks, ...)
+	int64_t bytesAllocated;
+	int64_t nextGCRun;
+	// Where an allocation that would go over the heap limit unwinds to, once it raised the runtime error
+	jmp_buf heapLimitExceeded;
 
 	GC gc;
+	AllocationProfiler profiler;
 } VM;
 
 // function prototypes
@@ -52,10 +71,14 @@ InterpreterResult runVM();
 
 bool trueOrFalse(Value);
 Object* concatenate();
-void mutate_vm_ip(uint8_t, uint16_t);
 void closeObjUpvalue(int);
-void closeObjUpvalues();
+void closeObjUpvalues(Value*, Value*);
+int getGlobalSlot(ObjectString*);
+int getSelector(ObjectString*);
 int findAndBindMethod(ObjectInstance*, ObjectClass*, ObjectString*);
+bool lookupField(InlineCache*, ObjectInstance*, ObjectString*, Value*);
+void cacheMethod(InlineCache*, ObjectClass*, ObjectClosure*);
+void storeField(InlineCache*, ObjectInstance*, ObjectString*, Value);
 
 
 void declareNativeFunctions();
@@ -63,6 +86,8 @@ void declareNativeFunction(char[], int, NativeFunction);
 bool clockNativeFunction();
 bool inputNativeFunction();
 bool numberNativeFunction();
+bool gcStatsNativeFunction();
+bool heapSnapshotNativeFunction();
 
 void runtimeError(char*,...);
 bool callNoErrors(int, Value);